@@ -12,6 +12,12 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// binit() allocates NBUF buffers, which are always kept. If
+// all NBUF are in use, bget() allocates another rather than
+// fail, and brelse() frees it again when it is released; if
+// there is no memory for one either, bget() waits for a
+// buffer to be released.
 
 
 #include "types.h"
@@ -25,7 +31,9 @@
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kcache *cache;
+  int n;       // buffers allocated
+  int nwait;   // bget()s waiting for a buffer to be released
 
   // Linked list of all buffers, through prev/next.
   // Sorted by how recently the buffer was used.
@@ -33,23 +41,67 @@ struct {
   struct buf head;
 } bcache;
 
+static struct buf* bnew(void);
+
 void
 binit(void)
 {
-  struct buf *b;
-
   initlock(&bcache.lock, "bcache");
+  bcache.cache = kcachecreate("buf", sizeof(struct buf));
 
-  // Create linked list of buffers
+  // Create an empty list of buffers
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+
+  // NBUF buffers are always kept, so allocate them now;
+  // bget() needs memory only for buffers beyond those.
+  acquire(&bcache.lock);
+  while(bcache.n < NBUF)
+    if(bnew() == 0)
+      panic("binit");
+  release(&bcache.lock);
+}
+
+// Allocate a new buffer and put it at the head of the list.
+// Returns 0 if there is no memory for it.
+// Caller must hold bcache.lock.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if((b = kcachealloc(bcache.cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
+  bcache.n++;
+  return b;
+}
+
+// Put b, which no one is using any more, at the head of the
+// list, or free it if there are more than NBUF buffers and no
+// bget() is waiting for one.
+// Caller must hold bcache.lock.
+static void
+bput(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  if(bcache.nwait)
+    wakeup(&bcache);
+  else if(bcache.n > NBUF){
+    bcache.n--;
+    kmfree(b);
+    return;
   }
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -62,30 +114,58 @@ bget(uint dev, uint blockno)
 
   acquire(&bcache.lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  for(;;){
+    // Is the block already cached?
+    for(b = bcache.head.next; b != &bcache.head; b = b->next){
+      if(b->dev == dev && b->blockno == blockno){
+        b->refcnt++;
+        release(&bcache.lock);
+        acquiresleep(&b->lock);
+        return b;
+      }
     }
-  }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+    // Not cached.
+    // Allocate a buffer if there are fewer than NBUF, else
+    // recycle the least recently used (LRU) unused buffer,
+    // else allocate one beyond NBUF.
+    b = 0;
+    if(bcache.n >= NBUF){
+      for(b = bcache.head.prev; b != &bcache.head; b = b->prev)
+        if(b->refcnt == 0)
+          break;
+      if(b == &bcache.head)
+        b = 0;
     }
+    if(b != 0 || (b = bnew()) != 0)
+      break;
+
+    // every buffer is in use and there is no memory for
+    // another; wait for one to be released, then look again,
+    // since another process may have read the block meanwhile.
+    bcache.nwait++;
+    sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
   }
-  panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Return a locked buf for the indicated block without reading
+// it from disk, for a caller that will overwrite all of it.
+struct buf*
+bfresh(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -125,12 +205,7 @@ brelse(struct buf *b)
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bput(b);
   }
   
   release(&bcache.lock);
@@ -147,6 +222,8 @@ void
 bunpin(struct buf *b) {
   acquire(&bcache.lock);
   b->refcnt--;
+  if(b->refcnt == 0)
+    bput(b);
   release(&bcache.lock);
 }
 
@@ -1,7 +1,10 @@
 struct buf;
 struct context;
+struct dirstat;
 struct file;
 struct inode;
+struct kcache;
+struct page;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -16,6 +19,7 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+struct buf*     bfresh(uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +28,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execpage(struct proc*, uint64, int, char**, int*);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,19 +38,31 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesend(struct file*, struct file*, int);
+int             filepread(struct file*, uint64, int n, uint);
+int             filepwrite(struct file*, uint64, int n, uint);
+int             filegetdents(struct file*, uint64, int n, int);
+int             fileallocate(struct file*, uint, uint);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+int             dirread(struct inode*, uint*, struct dirstat*, struct inode**, int);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+int             iexec(struct inode*, int);
+int             iwriter(struct inode*, int);
 void            iinit();
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+void            iwritedirty(void);
+int             idirtyfull(int);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
@@ -53,6 +70,11 @@ int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             iallocate(struct inode*, uint, uint);
+void            ireclaim(void);
+void            iflush(struct inode*);
+struct page*    ipage(struct inode*, uint);
+int             iwriteback(struct inode*, struct page*);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -61,8 +83,17 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kallocdump(void);
 void            kfree(void *);
+void            kdup(void *);
+int             kowners(void *);
 void            kinit(void);
+int             kfreecount(void);
+int             kidle(void);
+void            kzeroer(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,11 +101,30 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+uint64          mmapfault(pagetable_t, uint64, int);
+struct page*    mmappage(struct inode*, uint);
+int             mmapfork(struct proc*, struct proc*);
+void            munmapall(struct proc*);
+int             vmaoverlap(struct proc*, uint64, uint64);
+
+// pcache.c
+void            pcacheinit(void);
+struct page*    pget(uint, uint, uint);
+void            pput(struct page*);
+void            pdup(struct page*);
+struct page*    pfind(void*);
+int             pcached(void*);
+void            pinval(uint, uint);
+int             preclaim(void);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 int            printf(char*, ...) __attribute__ ((format (printf, 1, 2)));
@@ -100,6 +150,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread(void (*)(void), char*);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -122,8 +173,18 @@ void            pop_off(void);
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// slab.c
+void            kmallocinit(void);
+struct kcache*  kcachecreate(char*, uint);
+void*           kcachealloc(struct kcache*);
+void*           kmalloc(uint);
+void            kmfree(void*);
+void            kmallocdump(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -133,6 +194,14 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(uint, uint);
+void            swapdup(int);
+void            swapfree(int);
+int             swapout(int);
+void            swapcheck(void);
+uint64          swapin(pte_t*);
+
 // syscall.c
 void            argint(int, int*);
 int             argstr(int, char*, int);
@@ -165,9 +234,18 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+uint64          cowfault(pagetable_t, uint64);
+uint64          lazyfault(pagetable_t, uint64, int);
+int             uvmswapscan(pagetable_t, uint64*, uint64, pte_t**, int);
+void            uvmfaultin(uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
+void            uvmflush(pagetable_t, uint64);
+uint64          uvmsatp(struct proc*);
+void            uvmwindow(struct proc*);
+int             uvmwindowfault(uint64, int);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
@@ -183,7 +261,12 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_page(uint, void *, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+// the write argument of lazyfault() and mmapfault() for an
+// instruction fetch, rather than a read (0) or a write (1).
+#define FAULT_EXEC 2
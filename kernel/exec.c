@@ -4,10 +4,14 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "page.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 int flags2perm(int flags)
 {
@@ -23,21 +27,25 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, n, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exip = 0, *oldexip;
   struct proghdr ph;
+  struct xseg xseg[NXSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // make room for the new image's stack and page tables.
+  swapcheck();
+
   begin_op();
 
   if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -49,7 +57,10 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments. Nothing is read yet;
+  // execpage() reads each page when it is first used.
+  memset(xseg, 0, sizeof(xseg));
+  n = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,15 +72,27 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > TRAPFRAME)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(n == NXSEG)
       goto bad;
+    xseg[n].va = ph.vaddr;
+    xseg[n].memsz = ph.memsz;
+    xseg[n].off = ph.off;
+    xseg[n].filesz = ph.filesz;
+    xseg[n].perm = flags2perm(ph.flags);
+    n++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep the reference to the program's inode, for execpage(),
+  // unless the file is open for writing; see iexec().
+  if(iexec(ip, 1) < 0)
+    goto bad;
+  iunlockshared(ip);
   end_op();
+  exip = ip;
   ip = 0;
 
   p = myproc();
@@ -121,12 +144,23 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
+  oldexip = p->exip;
   p->pagetable = pagetable;
+  p->asidgen = 0;  // the TLB may hold the old page table's entries
   p->sz = sz;
+  p->exip = exip;
+  memmove(p->xseg, xseg, sizeof(xseg));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexip){
+    iexec(oldexip, -1);
+    begin_op();
+    iput(oldexip);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -134,33 +168,72 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
+    end_op();
+  }
+  if(exip){
+    iexec(exip, -1);
+    begin_op();
+    iput(exip);
     end_op();
   }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Find the page at user virtual address va of p's program,
+// if va is in one of the segments exec() recorded, set *mem
+// to it and *perm to the segment's permissions.
+// A read-only page that is a whole page of the file is the
+// page cache's page itself, shared by every process running
+// the program, and *mem holds a reference to it. Any other
+// page is a new one from kalloc(), with the file's bytes
+// copied in and the rest zero.
+// exec is set for an instruction fetch, which a segment
+// without PTE_X refuses.
+// Returns 1 if it did, 0 if va isn't in a segment, and -1 if
+// the segment refuses the fetch, the page couldn't be read,
+// or there is no memory.
+int
+execpage(struct proc *p, uint64 va, int exec, char **mem, int *perm)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+  struct xseg *s;
+  struct page *pg;
+  uint64 off, n, done, m;
+
+  for(s = p->xseg; s < &p->xseg[NXSEG]; s++)
+    if(s->memsz && va >= s->va && va < s->va + s->memsz)
+      break;
+  if(s == &p->xseg[NXSEG])
+    return 0;
+  if(exec && (s->perm & PTE_X) == 0)
+    return -1;
+  *perm = s->perm;
+
+  n = 0;
+  if(va - s->va < s->filesz)
+    n = min(s->filesz - (va - s->va), PGSIZE);
+  off = s->off + (va - s->va);
+  if((s->perm & PTE_W) == 0 && off % PGSIZE == 0 &&
+     n == min(s->memsz - (va - s->va), PGSIZE)){
+    if((pg = mmappage(p->exip, off / PGSIZE)) == 0)
+      return -1;
+    *mem = pg->data;
+    return 1;
+  }
+
+  // the bytes from the file; the rest of the page stays zero.
+  if((*mem = kalloc_zeroed()) == 0)
+    return -1;
+  for(done = 0; done < n; done += m){
+    off = s->off + (va - s->va) + done;
+    m = min(n - done, PGSIZE - off % PGSIZE);
+    if((pg = mmappage(p->exip, off / PGSIZE)) == 0){
+      kfree(*mem);
       return -1;
+    }
+    memmove(*mem + done, pg->data + off % PGSIZE, m);
+    pput(pg);
   }
-  
-  return 0;
+  return 1;
 }
@@ -12,17 +12,24 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "page.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define NDENTS 8   // directory entries per filegetdents() pass
+#define READCHUNK (16*PGSIZE)  // most fileread1() reads with one lock
 
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kcache *cache;
+  int n;        // files allocated, at most NFILE
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kcachecreate("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -32,15 +39,15 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.n == NFILE || (f = kcachealloc(ftable.cache)) == 0){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.n++;
   release(&ftable.lock);
-  return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,13 +76,17 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.n--;
   release(&ftable.lock);
+  kmfree(f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+    if(ff.type == FD_INODE && ff.writable){
+      iflush(ff.ip);
+      iwriter(ff.ip, -1);
+    }
     begin_op();
     iput(ff.ip);
     end_op();
@@ -91,9 +102,9 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -101,27 +112,68 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
-// Read from file f.
-// addr is a user virtual address.
-int
-fileread(struct file *f, uint64 addr, int n)
+// Lock f's inode for reading at *poff: shared, unless poff
+// is f->off and another process may be using it too, in
+// which case the lock keeps their offset updates in order.
+// Only a holder of f can dup it, so f->ref can't go from 1
+// to more while we read.
+static int
+filelockread(struct file *f, uint *poff)
 {
-  int r = 0;
+  if(poff != &f->off || f->ref == 1){
+    ilockshared(f->ip);
+    return 1;
+  }
+  ilock(f->ip);
+  return 0;
+}
+
+static void
+fileunlockread(struct file *f, int shared)
+{
+  if(shared)
+    iunlockshared(f->ip);
+  else
+    iunlock(f->ip);
+}
+
+// Read from file f, at *poff if f is an inode.
+// If user_dst==1, then addr is a user virtual address;
+// otherwise, addr is a kernel address.
+static int
+fileread1(struct file *f, int user_dst, uint64 addr, int n, uint *poff)
+{
+  int r = 0, m, m1, shared;
 
   if(f->readable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, user_dst, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    r = devsw[f->major].read(user_dst, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // a chunk at a time, with the user pages mapped before
+    // the inode is locked; see uvmfaultin().
+    while(r < n){
+      m = min(n - r, READCHUNK);
+      if(user_dst)
+        uvmfaultin(addr + r, m, 1);
+      shared = filelockread(f, poff);
+      if((m1 = readi(f->ip, user_dst, addr + r, *poff, m)) > 0)
+        *poff += m1;
+      fileunlockread(f, shared);
+      if(m1 < 0){
+        if(r == 0)
+          r = -1;
+        break;
+      }
+      r += m1;
+      if(m1 < m)
+        break;
+    }
   } else {
     panic("fileread");
   }
@@ -129,10 +181,29 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
-// Write to file f.
+// Read from file f.
 // addr is a user virtual address.
 int
-filewrite(struct file *f, uint64 addr, int n)
+fileread(struct file *f, uint64 addr, int n)
+{
+  return fileread1(f, 1, addr, n, &f->off);
+}
+
+// Read from file f at offset off, leaving f->off alone.
+// addr is a user virtual address.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->type != FD_INODE)
+    return -1;
+  return fileread1(f, 1, addr, n, &off);
+}
+
+// Write to file f, at *poff if f is an inode.
+// If user_src==1, then addr is a user virtual address;
+// otherwise, addr is a kernel address.
+static int
+filewrite1(struct file *f, int user_src, uint64 addr, int n, uint *poff)
 {
   int r, ret = 0;
 
@@ -140,11 +211,11 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -159,10 +230,13 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // map the user pages before locking; see uvmfaultin().
+      if(user_src)
+        uvmfaultin(addr + i, n1, 0);
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
+      if ((r = writei(f->ip, user_src, addr + i, *poff, n1)) > 0)
+        *poff += r;
       iunlock(f->ip);
       end_op();
 
@@ -171,6 +245,11 @@ filewrite(struct file *f, uint64 addr, int n)
         break;
       }
       i += r;
+
+      // write out delayed blocks before too many pile up.
+      // reading ndelayed without the lock is only a hint.
+      if(f->ip->ndelayed >= NDELAY)
+        iflush(f->ip);
     }
     ret = (i == n ? n : -1);
   } else {
@@ -180,3 +259,159 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  return filewrite1(f, 1, addr, n, &f->off);
+}
+
+// Write to file f at offset off, leaving f->off alone.
+// addr is a user virtual address.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->type != FD_INODE)
+    return -1;
+  return filewrite1(f, 1, addr, n, &off);
+}
+
+// Give back the last n bytes that filesend() took from inode
+// file in, up to offset end, if no one has moved in->off
+// since.
+static void
+fileunread(struct file *in, uint end, int n)
+{
+  int shared;
+
+  shared = filelockread(in, &in->off);
+  if(in->off == end)
+    in->off -= n;
+  fileunlockread(in, shared);
+}
+
+// Move up to n bytes from file in to file out without going
+// through user memory, advancing in->off as read() would and
+// out->off as write() would. A regular file is written out
+// of its page cache pages; anything else is read into a
+// kernel page first. Bytes of an inode that out doesn't take
+// are left in in; those of a pipe or device are lost.
+// Returns the number of bytes moved, or -1 if none could be.
+int
+filesend(struct file *out, struct file *in, int n)
+{
+  struct page *pg;
+  char *buf = 0;
+  uint off = 0, start = 0;
+  int tot, m, got, w, r = 0, shared;
+
+  if(in->readable == 0 || out->writable == 0)
+    return -1;
+
+  for(tot = 0; tot < n; ){
+    m = min(n - tot, PGSIZE);
+    pg = 0;
+    if(in->type == FD_INODE){
+      // claim the bytes by moving in->off past them, under
+      // the lock that keeps offset updates in order for
+      // read().
+      shared = filelockread(in, &in->off);
+      start = off = in->off;
+      if(off >= in->ip->size){
+        fileunlockread(in, shared);
+        r = 0;
+        break;
+      }
+      m = min(m, in->ip->size - off);
+      if(in->ip->type == T_FILE){
+        m = min(m, PGSIZE - off % PGSIZE);
+        pg = ipage(in->ip, off / PGSIZE);
+      }
+      in->off = off + m;
+      fileunlockread(in, shared);
+    }
+
+    got = 0;
+    r = -1;
+    if(pg){
+      // the page stays put while we hold it, so the inode
+      // needn't stay locked while out takes its time.
+      got = m;
+      r = filewrite1(out, 0, (uint64)pg->data + off % PGSIZE, m, &out->off);
+      pput(pg);
+    } else if(buf != 0 || (buf = kalloc()) != 0){
+      // an inode is read at the offset claimed above.
+      got = fileread1(in, 0, (uint64)buf, m, in->type == FD_INODE ? &off : &in->off);
+      r = got;
+      if(got > 0)
+        r = filewrite1(out, 0, (uint64)buf, got, &out->off);
+    }
+    w = r > 0 ? r : 0;
+    if(in->type == FD_INODE && w < m)
+      fileunread(in, start + m, m - w);
+    if(r <= 0)
+      break;
+    tot += r;
+    if(r < got)
+      break;
+  }
+
+  if(buf)
+    kfree(buf);
+  if(tot == 0 && r < 0)
+    return -1;
+  return tot;
+}
+
+// Read up to n entries of directory f into the array of
+// struct dirstat at user address addr, advancing f->off past
+// them, and fill in each entry's stat if flags has GD_STAT.
+// The directory is unlocked while the entries are stat'ed,
+// so that they can be locked in any order.
+// Returns the number of entries, 0 at the end, or -1.
+int
+filegetdents(struct file *f, uint64 addr, int n, int flags)
+{
+  struct proc *p = myproc();
+  struct dirstat ds[NDENTS];
+  struct inode *ips[NDENTS];
+  int i, m, tot, shared;
+
+  if(f->type != FD_INODE || f->readable == 0 || f->ip->type != T_DIR || n < 0)
+    return -1;
+
+  for(tot = 0; tot < n; tot += m){
+    if(flags & GD_STAT)
+      begin_op();
+    shared = filelockread(f, &f->off);
+    m = dirread(f->ip, &f->off, ds, (flags & GD_STAT) ? ips : 0, min(n - tot, NDENTS));
+    fileunlockread(f, shared);
+    if(flags & GD_STAT){
+      for(i = 0; i < m; i++){
+        ilockshared(ips[i]);
+        stati(ips[i], &ds[i].st);
+        iunlockshared(ips[i]);
+        iput(ips[i]);
+      }
+      end_op();
+    }
+    if(m == 0)
+      break;
+    if(copyout(p->pagetable, addr + tot*sizeof(ds[0]), (char*)ds, m*sizeof(ds[0])) < 0)
+      return -1;
+  }
+  return tot;
+}
+
+// Give file f disk blocks for [off, off+len), growing it to
+// off+len if it is shorter.
+// Returns 0, or -1 if f isn't a writable regular file or the
+// disk is full.
+int
+fileallocate(struct file *f, uint off, uint len)
+{
+  if(f->type != FD_INODE || f->writable == 0 || f->ip->type != T_FILE)
+    return -1;
+  return iallocate(f->ip, off, len);
+}
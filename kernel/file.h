@@ -18,8 +18,15 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int nexec;          // processes running it as their program
+  int nwriter;        // open files that can write it
+  struct inode *next; // in itable's list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int dirty;          // to be copied to disk when the log commits
+  struct page *delayed; // pages with blocks not on disk yet
+  int ndelayed;       // number of such blocks
+  int nreserved;      // free blocks reserved for them
 
   short type;         // copy of disk inode
   short major;
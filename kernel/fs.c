@@ -20,12 +20,19 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "page.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+
+static char zeroes[BSIZE];  // for reading holes
+
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+static void bcount(int);
+static void iorphanscan(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,15 +51,19 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(sb.swapstart, sb.nswap);
+  bcount(dev);
+  iorphanscan(dev);
+  kthread(ireclaim, "ireclaim");
 }
 
-// Zero a block.
+// Zero a block, through the log.
 static void
 bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bfresh(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
@@ -60,15 +71,91 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Free-block accounting, so that delayed allocation can
+// promise blocks to a write without choosing them yet.
+struct {
+  struct spinlock lock;
+  int nfree;      // free blocks in the bitmap
+  int nreserved;  // of those, promised by breserve()
+} bstat;
+
+// Count the free blocks in the bitmap.
+static void
+bcount(int dev)
+{
+  int b, bi;
+  struct buf *bp;
+
+  initlock(&bstat.lock, "bstat");
+  for(b = 0; b < sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, sb));
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bstat.nfree++;
+    }
+    brelse(bp);
+  }
+}
+
+// Reserve n free blocks for a later balloc_at(..., 1).
+// Returns 0 on success, -1 if there aren't enough.
+static int
+breserve(int n)
+{
+  int r = -1;
+
+  acquire(&bstat.lock);
+  if(bstat.nfree - bstat.nreserved >= n){
+    bstat.nreserved += n;
+    r = 0;
+  }
+  release(&bstat.lock);
+  return r;
+}
+
+static void
+bunreserve(int n)
+{
+  acquire(&bstat.lock);
+  bstat.nreserved -= n;
+  release(&bstat.lock);
+}
+
+// Allocate a disk block, trying block goal first if it is
+// non-zero. A caller with reserved != 0 uses up a block it
+// reserved with breserve(); others can't take reserved blocks.
+// Does not zero the block.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc_at(uint dev, uint goal, int reserved)
 {
   int b, bi, m;
   struct buf *bp;
 
-  bp = 0;
+  acquire(&bstat.lock);
+  if(!reserved && bstat.nfree <= bstat.nreserved){
+    release(&bstat.lock);
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  bstat.nfree--;
+  if(reserved)
+    bstat.nreserved--;
+  release(&bstat.lock);
+
+  if(goal != 0 && goal < sb.size){
+    bp = bread(dev, BBLOCK(goal, sb));
+    bi = goal % BPB;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0){
+      bp->data[bi/8] |= m;
+      log_write(bp);
+      brelse(bp);
+      return goal;
+    }
+    brelse(bp);
+  }
+
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
@@ -77,14 +164,25 @@ balloc(uint dev)
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
         return b + bi;
       }
     }
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
-  return 0;
+  panic("balloc: free count");
+}
+
+// Allocate a zeroed disk block.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev)
+{
+  uint b;
+
+  b = balloc_at(dev, 0, 0);
+  if(b)
+    bzero(dev, b);
+  return b;
 }
 
 // Free a disk block.
@@ -102,6 +200,47 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+
+  acquire(&bstat.lock);
+  bstat.nfree++;
+  release(&bstat.lock);
+}
+
+// Look for n consecutive free blocks, searching forward
+// from block hint. Returns the first block of the run, or of
+// the longest shorter run, or 0 if there are no free blocks.
+// The blocks are not marked allocated; the result is only a
+// goal for balloc_at().
+static uint
+bfindrun(uint dev, uint n, uint hint)
+{
+  uint i, b, bi, start, len, best, bestlen;
+  struct buf *bp;
+
+  bp = 0;
+  start = len = best = bestlen = 0;
+  for(i = 0; i < sb.size && bestlen < n; i++){
+    b = (hint + i) % sb.size;
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    bi = b % BPB;
+    if(b == 0 || (bp->data[bi/8] & (1 << (bi % 8)))){
+      len = 0;
+      continue;
+    }
+    if(len++ == 0)
+      start = b;
+    if(len > bestlen){
+      best = start;
+      bestlen = len;
+    }
+  }
+  if(bp)
+    brelse(bp);
+  return best;
 }
 
 // Inodes.
@@ -169,27 +308,69 @@ bfree(int dev, uint b)
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold itable.lock while using any of those fields.
 //
+// The table is a list of entries allocated by iget() and freed
+// when the last reference goes and the inode is not dirty,
+// through ip->next, which itable.lock also protects. It holds
+// at most NINODE entries.
+//
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kcache *cache;
+  struct inode *head;
+  int n;        // entries in the list
+  int ndirty;   // of those, dirty ones
+  int nwait;    // iget()s waiting for an entry to be freed
 } itable;
 
+// Orphans are inodes with no links and no other references
+// whose blocks are still to be freed. iput() hands them to
+// the ireclaim() kernel thread, which holds the reference,
+// rather than freeing their blocks in the caller's
+// transaction. An orphan's on-disk inode has nlink == 0 and
+// a type, which no other inode does once the system has
+// booted, so fsinit() can find the orphans left by a crash.
+struct {
+  struct spinlock lock;
+  struct inode *ip[NORPHAN];
+  int n;
+} orphans;
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  initlock(&orphans.lock, "orphans");
+  itable.cache = kcachecreate("inode", sizeof(struct inode));
+}
+
+// Drop a reference to ip, freeing its table entry if that was
+// the last and the inode isn't waiting to be copied to disk.
+// Caller must hold itable.lock.
+static void
+iunref(struct inode *ip)
+{
+  struct inode **pp;
+
+  if(--ip->ref > 0 || ip->dirty)
+    return;
+  for(pp = &itable.head; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  itable.n--;
+  kmfree(ip);
+  if(itable.nwait)
+    wakeup(&itable);
 }
 
 static struct inode* iget(uint dev, uint inum);
+static int iorphan(struct inode*);
+static int iinline(struct inode*);
+static uint bmapped(struct inode*, uint);
+static int iassign(struct inode*, uint, uint);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -221,23 +402,82 @@ ialloc(uint dev, short type)
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
 // that lives on disk.
-// Caller must hold ip->lock.
+// The copy is made only once per transaction, by iwritedirty()
+// when the log commits; iupdate() just puts the inode's block
+// in the log and marks the inode dirty, so a file written in
+// many chunks doesn't copy its inode for each one.
+// Caller must hold ip->lock and be in a transaction.
 void
 iupdate(struct inode *ip)
 {
   struct buf *bp;
-  struct dinode *dip;
 
+  if(ip->dirty)
+    return;
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-  dip = (struct dinode*)bp->data + ip->inum%IPB;
-  dip->type = ip->type;
-  dip->major = ip->major;
-  dip->minor = ip->minor;
-  dip->nlink = ip->nlink;
-  dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+  acquire(&itable.lock);
+  ip->dirty = 1;
+  itable.ndirty++;
+  release(&itable.lock);
+}
+
+// Could nop operations, each changing up to MAXOPINODES
+// inodes, fill more than half of the inode table with dirty
+// inodes? Those stay in the table until the log commits, so
+// begin_op() waits for a commit instead; iget() would have no
+// room for inodes in use.
+int
+idirtyfull(int nop)
+{
+  int full;
+
+  acquire(&itable.lock);
+  full = itable.ndirty + nop*MAXOPINODES > NINODE/2;
+  release(&itable.lock);
+  return full;
+}
+
+// Copy each dirty inode into its block, which iupdate() put
+// in the log, just before the log commits.
+// No transaction is in progress, so no inode is changing.
+// A dirty inode stays in the table until then even if it has
+// no references; see iget(). A reference keeps each one in
+// the table while it is copied.
+void
+iwritedirty(void)
+{
+  struct inode *ip;
+  struct buf *bp;
+  struct dinode *dip;
+
+  for(;;){
+    acquire(&itable.lock);
+    for(ip = itable.head; ip && !ip->dirty; ip = ip->next)
+      ;
+    if(ip)
+      ip->ref++;
+    release(&itable.lock);
+    if(ip == 0)
+      break;
+
+    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    dip = (struct dinode*)bp->data + ip->inum%IPB;
+    dip->type = ip->type;
+    dip->major = ip->major;
+    dip->minor = ip->minor;
+    dip->nlink = ip->nlink;
+    dip->size = ip->size;
+    memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+    brelse(bp);
+
+    acquire(&itable.lock);
+    ip->dirty = 0;
+    itable.ndirty--;
+    iunref(ip);
+    release(&itable.lock);
+  }
 }
 
 // Find the inode with number inum on device dev
@@ -246,36 +486,85 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  for(;;){
+    // Is the inode already in the table?
+    // A dirty inode's disk copy is out of date, so the
+    // table's copy must be used, and kept, until commit.
+    for(ip = itable.head; ip; ip = ip->next){
+      if(ip->dev == dev && ip->inum == inum){
+        ip->ref++;
+        release(&itable.lock);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // Allocate an inode entry.
+    if(itable.n < NINODE && (ip = kcachealloc(itable.cache)) != 0)
+      break;
 
-  ip = empty;
+    // the table is full or there is no memory; wait for an
+    // entry to be freed, then look again, since another
+    // process may have added this inode meanwhile.
+    itable.nwait++;
+    sleep(&itable, &itable.lock);
+    itable.nwait--;
+  }
+
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->next = itable.head;
+  itable.head = ip;
+  itable.n++;
   release(&itable.lock);
 
   return ip;
 }
 
+// Count a process that starts (n = 1) or stops (n = -1)
+// running ip as its program. A file that is a program some
+// process runs can't be written, since the process maps the
+// file's page cache pages (see execpage()), so a program can't
+// start while its file is open for writing, and iwriter()
+// refuses the reverse. Returns -1 if ip is open for writing.
+int
+iexec(struct inode *ip, int n)
+{
+  int r = 0;
+
+  acquire(&itable.lock);
+  if(n > 0 && ip->nwriter > 0)
+    r = -1;
+  else
+    ip->nexec += n;
+  release(&itable.lock);
+  return r;
+}
+
+// Count an open file that can write ip (n = 1), or one that
+// is closed (n = -1). Returns -1 if a process runs ip as its
+// program; see iexec().
+int
+iwriter(struct inode *ip, int n)
+{
+  int r = 0;
+
+  acquire(&itable.lock);
+  if(n > 0 && ip->nexec > 0)
+    r = -1;
+  else
+    ip->nwriter += n;
+  release(&itable.lock);
+  return r;
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
@@ -326,6 +615,36 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode in shared mode, for reading only:
+// readi(), stati(), dirlookup(). Other readers can hold it
+// at the same time; ilock() waits for all of them.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquiresleepshared(&ip->lock);
+
+  if(ip->valid == 0){
+    // read it in under the exclusive lock.
+    // it stays valid while we hold a reference.
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+    acquiresleepshared(&ip->lock);
+  }
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -338,9 +657,20 @@ iput(struct inode *ip)
 {
   acquire(&itable.lock);
 
+  if(ip->ref == 1 && ip->valid && ip->nlink > 0 && ip->delayed)
+    panic("iput: delayed blocks");
+
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
 
+    // leave a file with blocks to ireclaim(), which takes
+    // over our reference. ref == 1 means no one else can
+    // be changing ip's size.
+    if(!iinline(ip) && iorphan(ip)){
+      release(&itable.lock);
+      return;
+    }
+
     // ip->ref == 1 means no other process can have ip locked,
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
@@ -357,7 +687,7 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  iunref(ip);
   release(&itable.lock);
 }
 
@@ -375,9 +705,64 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// A file or directory whose size is at most NINLINE bytes
+// instead keeps its content in ip->addrs[] itself, so that
+// reading it costs only the read of its inode block.
+// Sizes only shrink through itrunc(), so the size alone
+// tells which representation an inode uses.
+
+// Is ip's content stored inline in ip->addrs[]?
+static int
+iinline(struct inode *ip)
+{
+  return ip->size <= NINLINE;
+}
+
+// Move the inline content of ip into a newly allocated
+// first data block.
+// Returns 0 on success, -1 if out of disk space.
+static int
+iexpand(struct inode *ip)
+{
+  char data[NINLINE];
+  uint addr;
+  struct buf *bp;
+
+  memmove(data, ip->addrs, NINLINE);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  if((addr = balloc(ip->dev)) == 0){
+    memmove(ip->addrs, data, NINLINE);
+    return -1;
+  }
+  ip->addrs[0] = addr;
+  bp = bread(ip->dev, addr);
+  memmove(bp->data, data, ip->size);
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Undo iexpand() when the write that needed the
+// space ended up not growing the file.
+static void
+ishrink(struct inode *ip)
+{
+  uint addr;
+  struct buf *bp;
+
+  addr = ip->addrs[0];
+  bp = bread(ip->dev, addr);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  memmove(ip->addrs, bp->data, ip->size);
+  brelse(bp);
+  bfree(ip->dev, addr);
+  pinval(ip->dev, ip->inum);
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one; an unwritten
+// block is zeroed, since the caller may write only part of it.
 // returns 0 if out of disk space.
 static uint
 bmap(struct inode *ip, uint bn)
@@ -385,6 +770,13 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if((addr = bmapped(ip, bn)) & BUNWRITTEN){
+    addr = BADDR(addr);
+    bzero(ip->dev, addr);
+    iassign(ip, bn, addr);
+    return addr;
+  }
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
       addr = balloc(ip->dev);
@@ -420,10 +812,427 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
+// Return the disk block address of the nth block in inode ip,
+// with BUNWRITTEN set if it was never written, or 0 if it has
+// none: a hole, or a block whose allocation is delayed.
+// Never allocates.
+static uint
+bmapped(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT){
+    if((addr = ip->addrs[NDIRECT]) == 0)
+      return 0;
+    bp = bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+
+  panic("bmapped: out of range");
+}
+
+// File pages.
+//
+// The content of a regular file is read and written through
+// the page cache (pcache.c), BPP blocks to a page. A page is
+// read from disk as a whole when it is first used, and
+// writes go to the page and, for blocks that have a disk
+// address, through the log to the disk as well; so pages
+// never hold anything the disk doesn't, except for blocks
+// whose allocation is delayed.
+//
+// Delayed allocation.
+//
+// writei() doesn't allocate disk blocks for new content of
+// a regular file. It keeps the content in the page, marked
+// in pg->delayed, and only reserves a free block for it.
+// iflush() later picks disk addresses for all of ip's
+// delayed blocks at once, from one run of free blocks, and
+// writes them through the log. This keeps the bitmap out of
+// most write transactions, lays files out contiguously, and
+// means that a file that is unlinked before it is flushed
+// never gets disk blocks at all. Pages with delayed blocks
+// are kept referenced on ip->delayed, so they stay cached.
+//
+// Until a delayed block is flushed, the on-disk inode has
+// no address for it; after a crash it reads as zeros.
+
+#define BPP (PGSIZE/BSIZE)  // blocks per page
+
+// Flushing writes a few delayed blocks per transaction:
+// each needs its data block and a bitmap block in the log,
+// plus the inode, the indirect block and its bitmap block.
+#define FLUSHBLOCKS ((MAXOPBLOCKS-3)/2)
+
+// Return page pn of regular file ip, reading it in if it
+// isn't cached. Returns 0 if the page cache is out of pages.
+// Caller must hold ip->lock, perhaps shared.
+struct page*
+ipage(struct inode *ip, uint pn)
+{
+  struct page *pg;
+  struct buf *bp;
+  uint bn, addr;
+  int i;
+
+  if((pg = pget(ip->dev, ip->inum, pn)) == 0)
+    return 0;
+  if(pg->valid)
+    return pg;
+  // readers holding ip->lock shared may race to fill pg.
+  acquiresleep(&pg->lock);
+  if(!pg->valid){
+    for(i = 0; i < BPP; i++){
+      bn = pn*BPP + i;
+      addr = bn < MAXFILE ? bmapped(ip, bn) : 0;
+      if(addr != 0 && (addr & BUNWRITTEN) == 0){
+        bp = bread(ip->dev, addr);
+        memmove(pg->data + i*BSIZE, bp->data, BSIZE);
+        brelse(bp);
+      } else {
+        memset(pg->data + i*BSIZE, 0, BSIZE);
+      }
+    }
+    pg->valid = 1;
+  }
+  releasesleep(&pg->lock);
+  return pg;
+}
+
+// Delay the allocation of block i of page pg of ip, which has
+// no disk address, reserving a free block for it, and one for
+// the indirect block if it will need one.
+// Returns 0 on success, -1 if there is no disk space to
+// reserve, in which case the caller should allocate the
+// block right away.
 // Caller must hold ip->lock.
+static int
+idelay(struct inode *ip, struct page *pg, int i)
+{
+  struct page **pp;
+  int need;
+
+  // ip->nreserved > ip->ndelayed if the indirect block
+  // is reserved already.
+  need = 1;
+  if(pg->pn*BPP + i >= NDIRECT && ip->addrs[NDIRECT] == 0 &&
+     ip->nreserved == ip->ndelayed)
+    need = 2;
+  if(breserve(need) < 0)
+    return -1;
+
+  if(pg->delayed == 0){
+    // keep the list in file order, for iflush().
+    for(pp = &ip->delayed; *pp && (*pp)->pn < pg->pn; pp = &(*pp)->dnext)
+      ;
+    pg->dnext = *pp;
+    *pp = pg;
+    pdup(pg);  // the list's reference
+  }
+  pg->delayed |= 1 << i;
+  ip->ndelayed++;
+  ip->nreserved += need;
+  return 0;
+}
+
+// Throw away ip's delayed blocks and their reservations.
+// Caller must hold ip->lock.
+static void
+idiscard(struct inode *ip)
+{
+  struct page *pg;
+
+  while((pg = ip->delayed) != 0){
+    ip->delayed = pg->dnext;
+    pg->dnext = 0;
+    pg->delayed = 0;
+    pput(pg);
+  }
+  bunreserve(ip->nreserved);
+  ip->ndelayed = 0;
+  ip->nreserved = 0;
+}
+
+// Record addr as the disk address of block bn of ip,
+// allocating the indirect block if necessary.
+// Returns 0 on success, -1 if out of disk space.
+static int
+iassign(struct inode *ip, uint bn, uint addr)
+{
+  uint ind;
+  struct buf *bp;
+
+  if(bn < NDIRECT){
+    ip->addrs[bn] = addr;
+    return 0;
+  }
+  bn -= NDIRECT;
+
+  if((ind = ip->addrs[NDIRECT]) == 0){
+    // use the reservation idelay() made, if it is still there.
+    if(ip->nreserved > ip->ndelayed){
+      if((ind = balloc_at(ip->dev, 0, 1)) == 0)
+        panic("iassign: reserved block");
+      ip->nreserved--;
+      bzero(ip->dev, ind);
+    } else if((ind = balloc(ip->dev)) == 0){
+      return -1;
+    }
+    ip->addrs[NDIRECT] = ind;
+  }
+  bp = bread(ip->dev, ind);
+  ((uint*)bp->data)[bn] = addr;
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Return the index of the first delayed block of pg.
+static int
+pfirst(struct page *pg)
+{
+  int i;
+
+  for(i = 0; (pg->delayed & (1 << i)) == 0; i++)
+    ;
+  return i;
+}
+
+// Give ip's delayed blocks disk addresses and write them
+// through the log, FLUSHBLOCKS per transaction. The blocks
+// are placed in file order in a run of free blocks, starting
+// right after the file's preceding block if possible.
+// Unlinked files are left alone: itrunc() drops their
+// delayed blocks without ever allocating them.
+// Caller must not hold ip->lock or be in a transaction.
 void
-itrunc(struct inode *ip)
+iflush(struct inode *ip)
+{
+  struct page *pg;
+  struct buf *bp;
+  uint goal, hint, addr, bn;
+  int i, b;
+
+  goal = 0;
+  for(;;){
+    begin_op();
+    ilock(ip);
+    if(ip->delayed == 0 || ip->nlink == 0){
+      iunlock(ip);
+      end_op();
+      return;
+    }
+    if(goal == 0){
+      hint = 0;
+      bn = ip->delayed->pn*BPP + pfirst(ip->delayed);
+      if(bn > 0 && (hint = bmapped(ip, bn - 1)) != 0)
+        hint = BADDR(hint) + 1;
+      goal = bfindrun(ip->dev, ip->ndelayed, hint);
+    }
+    for(i = 0; i < FLUSHBLOCKS && (pg = ip->delayed) != 0; i++){
+      b = pfirst(pg);
+      bn = pg->pn*BPP + b;
+      pg->delayed &= ~(1 << b);
+      ip->ndelayed--;
+      // idelay() reserved this block, and the indirect block
+      // if bn needs it, so neither allocation can fail; the
+      // data was already reported as written.
+      addr = balloc_at(ip->dev, goal, 1);
+      ip->nreserved--;
+      if(addr == 0 || iassign(ip, bn, addr) < 0)
+        panic("iflush: reserved block");
+      goal = addr + 1;
+      bp = bfresh(ip->dev, addr);
+      memmove(bp->data, pg->data + b*BSIZE, BSIZE);
+      log_write(bp);
+      brelse(bp);
+      if(pg->delayed == 0){
+        ip->delayed = pg->dnext;
+        pg->dnext = 0;
+        pput(pg);
+      }
+    }
+    if(ip->delayed == 0 && ip->nreserved > 0){
+      // the indirect block was allocated some other way.
+      bunreserve(ip->nreserved);
+      ip->nreserved = 0;
+    }
+    iupdate(ip);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Is block bn of ip delayed?
+static int
+idelayed(struct inode *ip, uint bn)
+{
+  struct page *pg;
+
+  for(pg = ip->delayed; pg; pg = pg->dnext)
+    if(pg->pn == bn/BPP)
+      return (pg->delayed >> (bn%BPP)) & 1;
+  return 0;
+}
+
+// Give disk blocks to the holes of ip in [off, off+len),
+// in a run of free blocks if possible, FLUSHBLOCKS per
+// transaction, and make ip at least off+len bytes long.
+// The new blocks are marked BUNWRITTEN rather than zeroed,
+// so they cost no disk writes until they are written to,
+// and read as zeros until then, whatever is on the disk.
+// Returns 0, or -1 if out of disk space, in which case ip
+// keeps the blocks it got.
+// Caller must not hold ip->lock or be in a transaction.
+int
+iallocate(struct inode *ip, uint off, uint len)
+{
+  uint bn, last, goal, hint, addr;
+  int i, r;
+
+  if(off + len < off || off + len > MAXFILE*BSIZE)
+    return -1;
+  if(len == 0)
+    return 0;
+
+  // grow ip first, so that its blocks are never taken
+  // for inline content.
+  begin_op();
+  ilock(ip);
+  r = 0;
+  if(off + len > ip->size){
+    if(iinline(ip) && ip->size > 0 && off + len > NINLINE)
+      r = iexpand(ip);
+    if(r == 0){
+      ip->size = off + len;
+      iupdate(ip);
+    }
+  }
+  iunlock(ip);
+  end_op();
+  if(r < 0 || off + len <= NINLINE)
+    return r;  // inline content has no blocks
+
+  bn = off / BSIZE;
+  last = (off + len - 1) / BSIZE;
+  goal = 0;
+  while(r == 0 && bn <= last){
+    begin_op();
+    ilock(ip);
+    for(i = 0; i < FLUSHBLOCKS && bn <= last; bn++){
+      if(bmapped(ip, bn) != 0 || idelayed(ip, bn))
+        continue;
+      if(goal == 0){
+        hint = 0;
+        if(bn > 0 && (hint = bmapped(ip, bn - 1)) != 0)
+          hint = BADDR(hint) + 1;
+        goal = bfindrun(ip->dev, last - bn + 1, hint);
+      }
+      if((addr = balloc_at(ip->dev, goal, 0)) == 0){
+        r = -1;
+        break;
+      }
+      goal = addr + 1;
+      if(iassign(ip, bn, addr | BUNWRITTEN) < 0){
+        bfree(ip->dev, addr);
+        r = -1;
+        break;
+      }
+      i++;
+    }
+    iupdate(ip);
+    iunlock(ip);
+    end_op();
+  }
+  return r;
+}
+
+// Write page pg of ip back to disk after it has been changed
+// through a shared mapping. Only the part inside the file is
+// written; blocks without a disk address are delayed.
+// Returns 0, or -1 if a block had no disk address and none
+// could be allocated, so that its data is lost.
+// Caller must hold ip->lock and be in a transaction.
+int
+iwriteback(struct inode *ip, struct page *pg)
+{
+  uint bn, addr;
+  struct buf *bp;
+  int i, r = 0;
+
+  if(pg->inum != ip->inum || pg->dev != ip->dev)
+    return 0;  // truncated while mapped
+  for(i = 0; i < BPP; i++){
+    bn = pg->pn*BPP + i;
+    if(bn >= MAXFILE || bn*BSIZE >= ip->size)
+      break;
+    if(pg->delayed & (1 << i))
+      continue;
+    if((addr = bmapped(ip, bn)) == 0){
+      if(idelay(ip, pg, i) == 0)
+        continue;
+      if((addr = bmap(ip, bn)) == 0){
+        r = -1;
+        continue;
+      }
+    } else if(addr & BUNWRITTEN){
+      addr = BADDR(addr);
+      iassign(ip, bn, addr);
+    }
+    bp = bfresh(ip->dev, addr);
+    memmove(bp->data, pg->data + i*BSIZE, BSIZE);
+    log_write(bp);
+    brelse(bp);
+  }
+  iupdate(ip);
+  return r;
+}
+
+// Write m bytes from src to ip at off, within one block,
+// through page pg: logged as usual if the block has a disk
+// address, delayed if it doesn't.
+// Returns 0 on success, -1 on a bad src or out of disk space.
+// Caller must hold ip->lock.
+static int
+iwritepage(struct inode *ip, struct page *pg, int user_src, uint64 src, uint off, uint m)
+{
+  int i = (off/BSIZE) % BPP;
+  uint addr;
+  struct buf *bp;
+
+  if(either_copyin(pg->data + off%PGSIZE, user_src, src, m) == -1)
+    return -1;
+  if(pg->delayed & (1 << i))
+    return 0;
+  if((addr = bmapped(ip, off/BSIZE)) == 0){
+    if(idelay(ip, pg, i) == 0)
+      return 0;
+    if((addr = bmap(ip, off/BSIZE)) == 0){
+      memset(pg->data + off%PGSIZE, 0, m);
+      return -1;
+    }
+  } else if(addr & BUNWRITTEN){
+    addr = BADDR(addr);
+    iassign(ip, off/BSIZE, addr);
+  }
+  // the page holds the whole block, so no need to read it.
+  bp = bfresh(ip->dev, addr);
+  memmove(bp->data, pg->data + i*BSIZE, BSIZE);
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
+
+// Free all of ip's blocks, leaving ip->addrs[] zero.
+static void
+ifreeblocks(struct inode *ip)
 {
   int i, j;
   struct buf *bp;
@@ -431,7 +1240,7 @@ itrunc(struct inode *ip)
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
+      bfree(ip->dev, BADDR(ip->addrs[i]));
       ip->addrs[i] = 0;
     }
   }
@@ -441,17 +1250,181 @@ itrunc(struct inode *ip)
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        bfree(ip->dev, BADDR(a[j]));
     }
     brelse(bp);
     bfree(ip->dev, ip->addrs[NDIRECT]);
     ip->addrs[NDIRECT] = 0;
   }
+}
 
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  idiscard(ip);
+  pinval(ip->dev, ip->inum);
+
+  if(iinline(ip))
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+  else
+    ifreeblocks(ip);
   ip->size = 0;
   iupdate(ip);
 }
 
+// Free up to n blocks of ip, last ones first, as one step
+// of truncating it over several transactions; each step
+// leaves ip consistent on disk.
+// Returns 1 once ip has no blocks left.
+// Caller must hold ip->lock.
+static int
+itruncstep(struct inode *ip, int n)
+{
+  int i, dirty;
+  struct buf *bp;
+  uint *a;
+
+  if(iinline(ip)){
+    itrunc(ip);
+    return 1;
+  }
+  idiscard(ip);
+  pinval(ip->dev, ip->inum);
+
+  if(ip->addrs[NDIRECT]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    a = (uint*)bp->data;
+    dirty = 0;
+    for(i = NINDIRECT-1; i >= 0; i--){
+      if(a[i] == 0)
+        continue;
+      if(n == 0)
+        break;
+      bfree(ip->dev, BADDR(a[i]));
+      a[i] = 0;
+      dirty = 1;
+      n--;
+      if(ip->size > (NDIRECT+i)*BSIZE)
+        ip->size = (NDIRECT+i)*BSIZE;
+    }
+    if(dirty)
+      log_write(bp);
+    brelse(bp);
+    if(i < 0 && n > 0){
+      bfree(ip->dev, ip->addrs[NDIRECT]);
+      ip->addrs[NDIRECT] = 0;
+      n--;
+    }
+  }
+
+  if(ip->addrs[NDIRECT] == 0){
+    for(i = NDIRECT-1; i >= 0 && n > 0; i--){
+      if(ip->addrs[i]){
+        bfree(ip->dev, BADDR(ip->addrs[i]));
+        ip->addrs[i] = 0;
+        n--;
+        if(ip->size > i*BSIZE)
+          ip->size = i*BSIZE;
+      }
+    }
+  }
+
+  for(i = 0; i <= NDIRECT; i++)
+    if(ip->addrs[i])
+      break;
+  if(i > NDIRECT)
+    ip->size = 0;
+  iupdate(ip);
+  return i > NDIRECT;
+}
+
+// Add ip to the orphans, taking over the caller's reference.
+// Returns 0 if there are too many orphans already.
+static int
+iorphan(struct inode *ip)
+{
+  acquire(&orphans.lock);
+  if(orphans.n == NORPHAN){
+    release(&orphans.lock);
+    return 0;
+  }
+  orphans.ip[orphans.n++] = ip;
+  wakeup(&orphans);
+  release(&orphans.lock);
+  return 1;
+}
+
+// Free orphan ip's blocks a few at a time, in transactions
+// of their own, then free ip and drop the reference to it.
+static void
+ifree(struct inode *ip)
+{
+  int done;
+
+  do {
+    begin_op();
+    ilock(ip);
+    if(ip->nlink != 0)
+      panic("ifree");
+    if((done = itruncstep(ip, MAXOPBLOCKS-2)) != 0){
+      ip->type = 0;
+      iupdate(ip);
+      ip->valid = 0;
+    }
+    iunlock(ip);
+    end_op();
+  } while(!done);
+
+  acquire(&itable.lock);
+  iunref(ip);
+  release(&itable.lock);
+}
+
+// Collect the orphans that a crash left on dev, before
+// anything else uses the file system. Frees them right away
+// if there are too many to hand to ireclaim().
+static void
+iorphanscan(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  struct inode *ip;
+  uint inum;
+  int orphan;
+
+  for(inum = 1; inum < sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    orphan = dip->type != 0 && dip->nlink == 0;
+    brelse(bp);
+    if(orphan){
+      ip = iget(dev, inum);
+      if(!iorphan(ip))
+        ifree(ip);
+    }
+  }
+}
+
+// The kernel thread that frees the blocks of orphans,
+// so that unlinking or closing a big file doesn't wait
+// for it.
+void
+ireclaim(void)
+{
+  struct inode *ip;
+
+  for(;;){
+    acquire(&orphans.lock);
+    while(orphans.n == 0)
+      sleep(&orphans, &orphans.lock);
+    ip = orphans.ip[--orphans.n];
+    release(&orphans.lock);
+    ifree(ip);
+  }
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -473,18 +1446,44 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  struct page *pg;
+  int r;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(iinline(ip)){
+    if(either_copyout(user_dst, dst, (char*)ip->addrs + off, n) == -1)
+      return -1;
+    return n;
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
+    if(ip->type == T_FILE && (pg = ipage(ip, off/PGSIZE)) != 0){
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      r = either_copyout(user_dst, dst, pg->data + (off % PGSIZE), m);
+      pput(pg);
+      if(r == -1) {
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    // no page to spare: read through the buffer cache.
     m = min(n - tot, BSIZE - off%BSIZE);
+    uint addr = bmapped(ip, off/BSIZE);
+    if(addr == 0 || (addr & BUNWRITTEN)){
+      // a hole, a block never written, or a block lost to a
+      // crash before it was flushed.
+      if(either_copyout(user_dst, dst, zeroes, m) == -1) {
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+    bp = bread(ip->dev, addr);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       tot = -1;
@@ -507,18 +1506,51 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  struct page *pg;
+  int r, emptied = 0, expanded = 0;
 
-  if(off > ip->size || off + n < off)
+  // writing past the end leaves a hole, which
+  // reads as zeros and has no disk blocks.
+  if(off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  if(iinline(ip)){
+    if(off + n <= NINLINE){
+      // the content still fits in the inode.
+      if(either_copyin((char*)ip->addrs + off, user_src, src, n) == -1)
+        return -1;
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return n;
+    }
+    if(ip->size == 0){
+      // no content to move, so block 0 is delayed like the
+      // rest, rather than allocated now.
+      memset(ip->addrs, 0, sizeof(ip->addrs));
+      emptied = 1;
+    } else {
+      if(iexpand(ip) < 0)
+        return -1;
+      expanded = 1;
+    }
+  }
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(ip->type == T_FILE && (pg = ipage(ip, off/PGSIZE)) != 0){
+      r = iwritepage(ip, pg, user_src, src, off, m);
+      pput(pg);
+      if(r < 0)
+        break;
+      continue;
+    }
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
@@ -527,8 +1559,12 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     brelse(bp);
   }
 
-  if(off > ip->size)
+  if(tot > 0 && off > ip->size)
     ip->size = off;
+  else if(emptied)
+    ifreeblocks(ip);  // nothing was written; free what bmap() took.
+  else if(expanded && iinline(ip))
+    ishrink(ip);  // nothing was written; keep the content inline.
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
@@ -574,6 +1610,37 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   return 0;
 }
 
+// Read up to n used entries of directory dp into ds[],
+// starting at *poff and advancing it past them. If ips isn't
+// 0, also return a reference to each entry's inode in ips[],
+// which keeps the inode around until the caller's iput()
+// after dp is unlocked.
+// Returns the number of entries.
+// Caller must hold dp->lock, perhaps shared.
+int
+dirread(struct inode *dp, uint *poff, struct dirstat *ds, struct inode **ips, int n)
+{
+  struct dirent de;
+  int m;
+
+  if(dp->type != T_DIR)
+    panic("dirread not DIR");
+
+  for(m = 0; m < n && *poff + sizeof(de) <= dp->size; *poff += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, *poff, sizeof(de)) != sizeof(de))
+      panic("dirread read");
+    if(de.inum == 0)
+      continue;
+    memset(&ds[m], 0, sizeof(ds[m]));
+    memmove(ds[m].name, de.name, DIRSIZ);
+    ds[m].st.ino = de.inum;
+    if(ips)
+      ips[m] = iget(dp->dev, de.inum);
+    m++;
+  }
+  return m;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
@@ -659,21 +1726,24 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
     if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
-    iunlockput(ip);
+    iunlockshared(ip);
+    iput(ip);
     ip = next;
   }
   if(nameiparent){
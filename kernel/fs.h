@@ -7,10 +7,11 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                                  free bit map | data blocks | swap ]
 //
 // mkfs computes the super block and builds an initial file system. The
-// super block describes the disk layout:
+// super block describes the disk layout; the swap area follows the
+// file system, which doesn't use it.
 struct superblock {
   uint magic;        // Must be FSMAGIC
   uint size;         // Size of file system image (blocks)
@@ -20,6 +21,8 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of swap blocks
 };
 
 #define FSMAGIC 0x10203040
@@ -28,6 +31,16 @@ struct superblock {
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+// A block address with BUNWRITTEN set was given to the file by
+// fallocate() and has never been written: it reads as zeros.
+#define BUNWRITTEN 0x80000000
+#define BADDR(a) ((a) & ~BUNWRITTEN)
+
+// Files and directories of at most NINLINE bytes keep their
+// contents in the inode's addrs[] area instead of in data
+// blocks; they move to block-mapped storage when they grow.
+#define NINLINE (sizeof(uint)*(NDIRECT+1))
+
 // On-disk inode structure
 struct dinode {
   short type;           // File type
@@ -35,7 +48,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+1];   // Data block addresses, or inline data
 };
 
 // Inodes per block.
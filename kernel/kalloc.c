@@ -1,6 +1,35 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages, or
+// with kalloc_pages() physically contiguous blocks of
+// 2^order pages.
+//
+// Free memory is kept by a buddy allocator: a free block of
+// order k is 2^k pages, aligned to its size, on the list
+// kmem.free[k]. Allocation splits a larger block if there is
+// no block of the order wanted; freeing a block merges it
+// with its buddy, the other half of the block of order k+1,
+// whenever the buddy is free too.
+//
+// Each CPU keeps a list of free pages of its own, so that
+// kalloc() and kfree() usually touch no lock that another
+// CPU wants. A CPU whose list is empty refills it with a
+// batch of pages from the buddy allocator, or failing that
+// takes half of another CPU's list; a CPU whose list grows
+// too long gives a batch back to the buddy allocator.
+//
+// kalloc_zeroed() returns a page of zeros. It takes one from a
+// pool of pages that the kzeroer thread zeroes while the CPUs
+// have nothing else to do, and zeroes a page itself only when
+// the pool is empty.
+//
+// A page can have more than one owner, such as a page that
+// fork() shares between parent and child until one of them
+// writes it. kdup() adds an owner; kfree() frees the page only
+// when its last owner frees it.
+//
+// Pages are filled with junk on kalloc() and kfree() only in a
+// kernel built with KDEBUG.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +38,13 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH 32  // pages moved to or from the buddy allocator at once
+#define NKZERO 64  // pages kzeroer keeps zeroed
+
+#define NPHYS ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PIDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PADDR(i) ((struct run*)(KERNBASE + (uint64)(i) * PGSIZE))
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,27 +52,198 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // on the buddy lists only
 };
 
-struct {
+struct kpool {
   struct spinlock lock;
   struct run *freelist;
+  int n;           // pages on freelist
+};
+
+struct {
+  struct spinlock lock;
+  struct run *free[MAXORDER+1];  // free blocks of each order
+  int nfree[MAXORDER+1];         // blocks on free[]
+  int nalloc[MAXORDER+1];        // blocks handed out
+  int nfail[MAXORDER+1];         // kalloc_pages() failures
+  int n;                         // free pages
+  uchar order[NPHYS];            // order+1 of the free block starting at each page, or 0
 } kmem;
 
+struct kpool kcpu[NCPU];    // each CPU's list
+struct kpool kzero;         // zeroed pages
+
+// owners of each page beyond the first, changed atomically.
+int kref[NPHYS];
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kcpu[i].lock, "kmem_cpu");
+  initlock(&kzero.lock, "kzero");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Put the free block r of order k on its list.
+// Caller must hold kmem.lock.
+static void
+bpush(struct run *r, int k)
+{
+  r->prev = 0;
+  r->next = kmem.free[k];
+  if(r->next)
+    r->next->prev = r;
+  kmem.free[k] = r;
+  kmem.nfree[k]++;
+  kmem.n += 1 << k;
+  kmem.order[PIDX(r)] = k + 1;
+}
+
+// Take the free block r of order k off its list.
+// Caller must hold kmem.lock.
+static void
+bremove(struct run *r, int k)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[k] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.nfree[k]--;
+  kmem.n -= 1 << k;
+  kmem.order[PIDX(r)] = 0;
+}
+
+// Allocate a block of order k, splitting a larger one if
+// need be. Returns 0 if no block is big enough.
+// Caller must hold kmem.lock.
+static struct run*
+buddyalloc(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER && kmem.free[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  r = kmem.free[j];
+  bremove(r, j);
+  // give back the upper half until the block is the right size.
+  while(j > k){
+    j--;
+    bpush(PADDR(PIDX(r) + (1 << j)), j);
+  }
+  kmem.nalloc[k]++;
+  return r;
+}
+
+// Free the block r of order k, merging it with its buddy
+// for as long as the buddy is free.
+// Caller must hold kmem.lock.
+static void
+buddyfree(struct run *r, int k)
+{
+  uint64 i, b;
+
+  i = PIDX(r);
+  while(k < MAXORDER){
+    b = i ^ (1 << k);
+    if(b >= NPHYS || kmem.order[b] != k + 1)
+      break;
+    bremove(PADDR(b), k);
+    i &= ~(uint64)(1 << k);
+    k++;
+  }
+  bpush(PADDR(i), k);
+}
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddyfree((struct run*)p, 0);
+  release(&kmem.lock);
+}
+
+// Move up to n pages from the front of list from to the
+// buddy allocator.
+// Caller must hold from->lock and kmem.lock.
+static void
+kdrain(struct kpool *from, int n)
+{
+  struct run *r;
+
+  while(n-- > 0 && (r = from->freelist) != 0){
+    from->freelist = r->next;
+    from->n--;
+    buddyfree(r, 0);
+  }
+}
+
+// Move up to n pages from the front of list from to list to.
+// Caller must hold both locks.
+static void
+kmove(struct kpool *to, struct kpool *from, int n)
+{
+  struct run *r;
+
+  while(n-- > 0 && (r = from->freelist) != 0){
+    from->freelist = r->next;
+    from->n--;
+    r->next = to->freelist;
+    to->freelist = r;
+    to->n++;
+  }
+}
+
+// Refill this CPU's empty list kc, from the buddy allocator
+// if it has pages, otherwise from another CPU's list.
+// Caller must hold kc->lock, with interrupts off.
+static void
+krefill(struct kpool *kc)
+{
+  struct kpool *k, *other;
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(kc->n < KBATCH && (r = buddyalloc(0)) != 0){
+    r->next = kc->freelist;
+    kc->freelist = r;
+    kc->n++;
+  }
+  release(&kmem.lock);
+
+  // Steal half of the longest other list. Reading n without
+  // the lock is only a hint. Locks of two CPU lists are
+  // taken in address order.
+  while(kc->n == 0){
+    other = 0;
+    for(k = kcpu; k < &kcpu[NCPU]; k++)
+      if(k != kc && k->n > 0 && (other == 0 || k->n > other->n))
+        other = k;
+    if(other == 0)
+      break;
+    if(other < kc){
+      release(&kc->lock);
+      acquire(&other->lock);
+      acquire(&kc->lock);
+    } else {
+      acquire(&other->lock);
+    }
+    if(kc->n == 0)
+      kmove(kc, other, (other->n + 1) / 2);
+    release(&other->lock);
+  }
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -47,19 +254,95 @@ void
 kfree(void *pa)
 {
   struct run *r;
+  struct kpool *kc;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // another owner still uses it? if two owners race to free
+  // it, the count goes below zero for the one that frees it.
+  if(__atomic_load_n(&kref[PIDX(pa)], __ATOMIC_ACQUIRE) > 0 &&
+     __atomic_sub_fetch(&kref[PIDX(pa)], 1, __ATOMIC_ACQ_REL) >= 0)
+    return;
+  kref[PIDX(pa)] = 0;
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->n++;
+  if(kc->n >= 2*KBATCH){
+    // give a batch back for other CPUs to use.
+    acquire(&kmem.lock);
+    kdrain(kc, KBATCH);
+    release(&kmem.lock);
+  }
+  release(&kc->lock);
+  pop_off();
+}
+
+// Take a page off this CPU's list, refilling it if it is
+// empty. Returns 0 if there are no free pages.
+static struct run*
+kpop(void)
+{
+  struct run *r;
+  struct kpool *kc;
+
+  push_off();
+  kc = &kcpu[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist == 0)
+    krefill(kc);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->n--;
+  }
+  release(&kc->lock);
+  pop_off();
+  return r;
+}
+
+// Take a page out of the pool of zeroed pages, or return 0
+// if the pool is empty.
+static struct run*
+kzeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r){
+    kzero.freelist = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+// Add an owner to the page at pa, which must already have one.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  __atomic_add_fetch(&kref[PIDX(pa)], 1, __ATOMIC_ACQ_REL);
+}
+
+// Return the number of owners of the page at pa.
+int
+kowners(void *pa)
+{
+  return __atomic_load_n(&kref[PIDX(pa)], __ATOMIC_ACQUIRE) + 1;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +353,174 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  // out of memory: use a zeroed page, then take a page back
+  // from the file page cache.
+  while((r = kpop()) == 0 && (r = kzeropop()) == 0)
+    if(preclaim() == 0)
+      break;
+
+#ifdef KDEBUG
   if(r)
-    kmem.freelist = r->next;
+    memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one 4096-byte page of zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kzeropop()) == 0 && (r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Give every page on the CPU lists and in the zeroed pool
+// back to the buddy allocator, so that they can merge into
+// larger blocks.
+static void
+kdrainall(void)
+{
+  struct kpool *kc;
+
+  for(kc = kcpu; kc < &kcpu[NCPU]; kc++){
+    acquire(&kc->lock);
+    acquire(&kmem.lock);
+    kdrain(kc, kc->n);
+    release(&kmem.lock);
+    release(&kc->lock);
+  }
+  acquire(&kzero.lock);
+  acquire(&kmem.lock);
+  kdrain(&kzero, kzero.n);
   release(&kmem.lock);
+  release(&kzero.lock);
+}
 
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+  int drained;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  for(drained = 0; ; drained = 1){
+    acquire(&kmem.lock);
+    r = buddyalloc(order);
+    if(r == 0 && drained)
+      kmem.nfail[order]++;
+    release(&kmem.lock);
+    if(r || drained)
+      break;
+    kdrainall();
+  }
+
+#ifdef KDEBUG
   if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+    memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Free the 2^order pages at pa, which must have come from
+// kalloc_pages(order). A block may also be freed a page at
+// a time with kfree().
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+#ifdef KDEBUG
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  buddyfree((struct run*)pa, order);
+  release(&kmem.lock);
+}
+
+// Print the buddy allocator's counts for each order.
+// For ^P on the console; takes no locks.
+void
+kallocdump(void)
+{
+  int k;
+
+  printf("kalloc: %d free pages, %d in buddy lists\n", kfreecount(), kmem.n);
+  for(k = 0; k <= MAXORDER; k++){
+    if(kmem.nfree[k] || kmem.nalloc[k] || kmem.nfail[k])
+      printf("order %d: %d free %d alloc %d fail\n",
+             k, kmem.nfree[k], kmem.nalloc[k], kmem.nfail[k]);
+  }
+}
+
+// Return the number of pages on the free lists, not counting
+// the zeroed pool. Reads the counts without locks, so the
+// result is only a hint while other CPUs allocate.
+static int
+kfreelists(void)
+{
+  int i, n;
+
+  n = kmem.n;
+  for(i = 0; i < NCPU; i++)
+    n += kcpu[i].n;
+  return n;
+}
+
+// Return the number of free pages.
+int
+kfreecount(void)
+{
+  return kfreelists() + kzero.n;
+}
+
+// Called by the scheduler when no process is runnable.
+// Wakes kzeroer if the pool of zeroed pages is short and
+// there are free pages to spare; returns 1 if it did.
+int
+kidle(void)
+{
+  if(kzero.n >= NKZERO || kfreelists() <= NKZERO)
+    return 0;
+  wakeup(&kzero);
+  return 1;
+}
+
+// Kernel thread that tops up the pool of zeroed pages each
+// time kidle() wakes it.
+void
+kzeroer(void)
+{
+  struct run *r;
+
+  for(;;){
+    acquire(&kzero.lock);
+    sleep(&kzero, &kzero.lock);
+    release(&kzero.lock);
+
+    while(kzero.n < NKZERO && kfreelists() > NKZERO && (r = kpop()) != 0){
+      memset((char*)r, 0, PGSIZE);
+      acquire(&kzero.lock);
+      r->next = kzero.freelist;
+      kzero.freelist = r;
+      kzero.n++;
+      release(&kzero.lock);
+    }
+  }
+}
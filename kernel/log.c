@@ -133,6 +133,10 @@ begin_op(void)
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
+    } else if(log.outstanding > 0 && idirtyfull(log.outstanding+1)){
+      // this op might fill the inode table with dirty
+      // inodes; wait for commit.
+      sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
       release(&log.lock);
@@ -194,6 +198,7 @@ static void
 commit()
 {
   if (log.lh.n > 0) {
+    iwritedirty();   // Copy dirty inodes into their blocks
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
     install_trans(0); // Now install writes to home locations
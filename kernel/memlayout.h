@@ -57,3 +57,11 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the kernel sees the current process's user memory below
+// TRAPFRAME at UWINDOW + va, for copyin() and copyout()
+// with sstatus.SUM set. these are the sign-extended addresses
+// of the upper half of Sv39, which user page tables don't use:
+// the top 256 entries of each CPU's copy of the kernel's root
+// page table are the process's bottom 256.
+#define UWINDOW 0xFFFFFFC000000000L
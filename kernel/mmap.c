@@ -0,0 +1,419 @@
+// Memory mappings.
+//
+// mmap() records a mapping in a free slot of p->vma[] and
+// maps nothing; pages are mapped one at a time by
+// mmapfault(), on a page fault from usertrap() or when the
+// kernel copies to or from the region.
+//
+// A shared mapping of a file maps the file's page cache
+// pages themselves, so reading a file this way copies
+// nothing, and changes are seen by read() right away and by
+// the disk when the page is unmapped. A private mapping of
+// a file maps page cache pages read-only, and copies a page
+// when it is first written. Anonymous mappings get zeroed
+// pages of their own.
+//
+// Mappings are placed top-down below the trapframe, so that
+// the heap grows up towards them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "stat.h"
+#include "page.h"
+#include "defs.h"
+
+// Find p's mapping that contains va.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+static struct vma*
+vmaalloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0)
+      return v;
+  return 0;
+}
+
+// Does any of p's mappings overlap [start, end)?
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && v->addr < end && v->addr + v->len > start)
+      return 1;
+  return 0;
+}
+
+static int
+vmaperm(struct vma *v)
+{
+  int perm = PTE_U;
+
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  return perm;
+}
+
+// Return the page cache page for page pn of ip, for a fault
+// in a mapping of ip or in a program segment read from ip.
+// A fault can happen while the kernel copies to or from user
+// memory with ip already locked by this process, or with a
+// spinlock held; in the latter case only an already cached
+// page can be used. A shared lock can be taken again even if
+// this process holds one already. fileread1() and filewrite1()
+// map user pages before they lock a file, so that a fault
+// doesn't wait here for ip while this process holds another
+// file's lock, perhaps wanted by ip's holder.
+struct page*
+mmappage(struct inode *ip, uint pn)
+{
+  struct page *pg;
+  int locked, spinning;
+
+  push_off();
+  spinning = mycpu()->noff > 1;
+  pop_off();
+
+  locked = holdingsleep(&ip->lock);
+  if(!locked){
+    if(spinning){
+      // can't sleep for ilock().
+      if((pg = pget(ip->dev, ip->inum, pn)) != 0 && !pg->valid){
+        pput(pg);
+        pg = 0;
+      }
+      return pg;
+    }
+    ilockshared(ip);
+  }
+  pg = ipage(ip, pn);
+  if(!locked)
+    iunlockshared(ip);
+  return pg;
+}
+
+// Handle a fault at user virtual address va of the current
+// process, whose page table is pagetable, for a write if
+// write is set, or an instruction fetch if it is FAULT_EXEC.
+// Returns the physical address of the page now mapped at va,
+// or 0 if va isn't in a mapping that allows the access.
+uint64
+mmapfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct page *pg;
+  pte_t *pte;
+  char *mem;
+  int perm;
+
+  if(p == 0 || pagetable != p->pagetable || (v = vmalookup(p, va)) == 0)
+    return 0;
+  if(write == FAULT_EXEC){
+    if((v->prot & PROT_EXEC) == 0)
+      return 0;
+    write = 0;
+  }
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return 0;
+  if(!write && v->prot == PROT_NONE)
+    return 0;
+  va = PGROUNDDOWN(va);
+  perm = vmaperm(v) | PTE_A;
+  if(write)
+    perm |= PTE_D;
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(!write || (*pte & PTE_W)){
+      // the hardware left setting A or D to us.
+      *pte |= perm & (PTE_A|PTE_D);
+      uvmflush(pagetable, va);
+      return PTE2PA(*pte);
+    }
+    // first write to a file page of a private mapping.
+    if((mem = kalloc()) == 0)
+      return 0;
+    if((pg = pfind((void*)PTE2PA(*pte))) == 0){
+      kfree(mem);
+      return 0;
+    }
+    memmove(mem, pg->data, PGSIZE);
+    *pte = PA2PTE(mem) | perm | PTE_V;
+    uvmflush(pagetable, va);
+    pput(pg);
+    return (uint64)mem;
+  }
+
+  if(v->f == 0){
+    if((mem = kalloc_zeroed()) == 0)
+      return 0;
+  } else {
+    if((pg = mmappage(v->f->ip, (v->off + va - v->addr) / PGSIZE)) == 0)
+      return 0;
+    if((v->flags & MAP_PRIVATE) && write){
+      if((mem = kalloc()) == 0){
+        pput(pg);
+        return 0;
+      }
+      memmove(mem, pg->data, PGSIZE);
+      pput(pg);
+    } else {
+      // map the cached page itself; the mapping keeps
+      // the reference.
+      mem = pg->data;
+      if(v->flags & MAP_PRIVATE)
+        perm &= ~PTE_W;
+    }
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    if((pg = pfind(mem)) != 0)
+      pput(pg);
+    else
+      kfree(mem);
+    return 0;
+  }
+  uvmflush(pagetable, va);
+  return (uint64)mem;
+}
+
+// Write a page of a shared file mapping back to disk.
+// Returns 0, or -1 if the disk is full and some of it is lost.
+static int
+mmapsync(struct inode *ip, struct page *pg)
+{
+  int r;
+
+  begin_op();
+  ilock(ip);
+  r = iwriteback(ip, pg);
+  iunlock(ip);
+  end_op();
+  return r;
+}
+
+// Unmap [start, end) of p's mapping v, which must be at one
+// end of v, writing changed pages of a shared mapping back.
+// Frees v if nothing is left of it.
+// Returns 0, or -1 if a changed page couldn't all be written.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct page *pg;
+  uint64 va, pa;
+  pte_t *pte;
+  int r = 0;
+
+  for(va = start; va < end; va += PGSIZE){
+    if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    if((pg = pfind((void*)pa)) != 0){
+      if((v->flags & MAP_SHARED) && (*pte & PTE_D) &&
+         mmapsync(v->f->ip, pg) < 0)
+        r = -1;
+      pput(pg);
+    } else {
+      kfree((void*)pa);
+    }
+    uvmunmap(p->pagetable, va, 1, 0);
+  }
+
+  if(start == v->addr && end == v->addr + v->len){
+    if(v->f)
+      fileclose(v->f);
+    memset(v, 0, sizeof(*v));
+  } else if(start == v->addr){
+    v->off += end - start;
+    v->addr = end;
+    v->len -= end - start;
+  } else {
+    v->len = start - v->addr;
+  }
+  return r;
+}
+
+// Map len bytes of f, from offset off, or anonymous memory
+// if f is 0, into the current process.
+// Returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *v1;
+  uint64 top;
+  int moved;
+
+  if(len == 0 || len > TRAPFRAME)
+    return -1;
+  len = PGROUNDUP(len);
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    // there is nothing for an anonymous mapping to share
+    // through except the page cache.
+    if(f || (flags & MAP_SHARED))
+      return -1;
+    off = 0;
+  } else {
+    if(f == 0 || f->type != FD_INODE || f->ip->type != T_FILE)
+      return -1;
+    if(off % PGSIZE)
+      return -1;
+    if(!f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  if((v = vmaalloc(p)) == 0)
+    return -1;
+
+  // the highest gap below the trapframe that fits.
+  top = TRAPFRAME;
+  do {
+    moved = 0;
+    for(v1 = p->vma; v1 < &p->vma[NVMA]; v1++){
+      if(v1->len && v1->addr < top && v1->addr + v1->len > top - len){
+        top = v1->addr;
+        moved = 1;
+      }
+    }
+  } while(moved && top >= len);
+  if(top < len || top - len < PGROUNDUP(p->sz))
+    return -1;
+
+  v->addr = top - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  return v->addr;
+}
+
+// Unmap the pages of the current process's mappings
+// in [addr, addr+len).
+// Returns 0, or -1 on a bad range, or if changes to a shared
+// mapping couldn't all be written for lack of disk space.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *v1;
+  uint64 start, end, vend;
+  int r = 0;
+
+  if(addr % PGSIZE || len == 0 || addr + len < addr || addr + len > MAXVA)
+    return -1;
+  end = PGROUNDUP(addr + len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0 || v->addr >= end || v->addr + v->len <= addr)
+      continue;
+    start = addr > v->addr ? addr : v->addr;
+    vend = v->addr + v->len;
+    if(start > v->addr && end < vend){
+      // a hole in the middle: split off the part above it.
+      if((v1 = vmaalloc(p)) == 0)
+        return -1;
+      *v1 = *v;
+      v1->addr = end;
+      v1->len = vend - end;
+      v1->off = v->off + (end - v->addr);
+      if(v1->f)
+        filedup(v1->f);
+      v->len = end - v->addr;
+      vend = end;
+    }
+    if(vmaunmap(p, v, start, end < vend ? end : vend) < 0)
+      r = -1;
+  }
+  return r;
+}
+
+// Give the new process np copies of p's mappings, where p is
+// the current process. Pages of the page cache are shared;
+// private pages are shared copy-on-write, as uvmcopy() shares
+// the rest of p's memory.
+// Returns 0 on success, or -1 on failure, which can leave np
+// with some of the mappings; the caller unmaps them with
+// munmapall(np).
+int
+mmapfork(struct proc *np, struct proc *p)
+{
+  struct vma *v, *nv;
+  struct page *pg;
+  uint64 va, pa;
+  pte_t *pte;
+  int flags, r = 0;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA] && r == 0; v++, nv++){
+    if(v->len == 0)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    for(va = v->addr; va < v->addr + v->len; va += PGSIZE){
+      if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      if((pg = pfind((void*)pa)) != 0){
+        pdup(pg);
+      } else {
+        if(*pte & PTE_W)
+          *pte = (*pte & ~PTE_W) | PTE_COW;
+        kdup((void*)pa);
+      }
+      flags = PTE_FLAGS(*pte) & ~PTE_D;
+      if(mappages(np->pagetable, va, PGSIZE, pa, flags) != 0){
+        if(pg)
+          pput(pg);
+        else
+          kfree((void*)pa);
+        r = -1;
+        break;
+      }
+    }
+  }
+  // p's writable private pages are read-only now.
+  uvmflush(p->pagetable, -1);
+  return r;
+}
+
+// Unmap all of p's mappings, on exit or exec, or when fork
+// fails.
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len)
+      vmaunmap(p, v, v->addr, v->addr + v->len);
+}
@@ -0,0 +1,15 @@
+struct page {
+  int valid;   // has data been read from disk?
+  uint dev;
+  uint inum;
+  uint pn;     // page number within the file
+  uint refcnt;
+  struct sleeplock lock; // held while data is read from disk
+  uchar delayed;     // blocks whose allocation is delayed, a bit each
+  char *data;        // PGSIZE bytes from kalloc(), or 0
+  struct page *hnext; // hash chain
+  struct page *prev; // LRU cache list
+  struct page *next;
+  struct page *dnext; // inode's list of pages with delayed blocks
+};
+
@@ -11,8 +11,16 @@
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define MAXOPINODES  4   // max # of inodes any FS op changes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NPAGE        2048  // max pages in the file page cache
+#define NDELAY       64  // flush a file with this many delayed blocks
+#define NVMA         16  // memory mappings per process
+#define NIOV         16  // max buffers for one readv() or writev()
+#define NXSEG         4  // program segments exec() loads on demand
+#define NORPHAN       8  // unlinked inodes waiting to be freed
+#define MAXORDER     10  // largest kalloc_pages() block is 2^MAXORDER pages
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -23,6 +31,7 @@
 #endif
 #endif
 #define MAXPATH      128   // maximum file path name
+#define NSWAP        65536 // size of swap area in blocks, after the file system
 
 #ifdef LAB_UTIL
 #define USERSTACK    2     // user stack pages
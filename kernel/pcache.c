@@ -0,0 +1,289 @@
+// Page cache.
+//
+// The page cache holds the contents of regular files in
+// PGSIZE pages, indexed by device, inode number, and page
+// number within the file. It is separate from the buffer
+// cache, which is left mostly to metadata, so that a hot
+// file stays cached however many inode and bitmap blocks
+// pass through the buffer cache. Pages outlive the in-memory
+// inode, so a file is still cached after its last close.
+//
+// Page memory comes from kalloc() when a page is first used.
+// The cache holds at most a quarter of the memory that is
+// free at boot, and at most NPAGE pages; kalloc() takes
+// pages back through preclaim() when it runs out.
+//
+// Interface:
+// * To get the page for part of a file, call pget.
+//   If pg->valid is 0, the caller reads it from disk.
+// * When done with the page, call pput.
+// * Call pinval when a file's content goes away.
+//
+// The file system (fs.c) keeps page contents consistent with
+// the disk; callers hold the inode's lock while they use a page.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "memlayout.h"
+#include "defs.h"
+#include "page.h"
+
+#define NPHASH 257
+#define PIDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+struct {
+  struct spinlock lock;
+  struct page page[NPAGE];
+  int npage;   // pages in use, from kfreecount() at boot
+  struct page *hash[NPHASH];
+  ushort pidx[(PHYSTOP-KERNBASE)/PGSIZE]; // page+1 for page memory, for pfind()
+
+  // Linked list of all pages in use, through prev/next.
+  // Sorted by how recently the page was used.
+  // head.next is most recent, head.prev is least.
+  struct page head;
+} pcache;
+
+static uint
+phash(uint dev, uint inum, uint pn)
+{
+  return (dev + inum*31 + pn) % NPHASH;
+}
+
+void
+pcacheinit(void)
+{
+  struct page *pg;
+
+  initlock(&pcache.lock, "pcache");
+
+  pcache.npage = kfreecount() / 4;
+  if(pcache.npage > NPAGE)
+    pcache.npage = NPAGE;
+
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  for(pg = pcache.page; pg < pcache.page+pcache.npage; pg++){
+    initsleeplock(&pg->lock, "page");
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+}
+
+// Remove pg from its hash chain, if it is on one.
+// Caller must hold pcache.lock.
+static void
+punhash(struct page *pg)
+{
+  struct page **pp;
+
+  for(pp = &pcache.hash[phash(pg->dev, pg->inum, pg->pn)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == pg){
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->hnext = 0;
+  pg->valid = 0;
+  pg->dev = pg->inum = pg->pn = 0;
+}
+
+// Move pg to the least recently used end of the LRU list,
+// so that it is the next to be recycled.
+// Caller must hold pcache.lock.
+static void
+plast(struct page *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  pg->next = &pcache.head;
+  pg->prev = pcache.head.prev;
+  pcache.head.prev->next = pg;
+  pcache.head.prev = pg;
+}
+
+static struct page*
+plookup(uint dev, uint inum, uint pn)
+{
+  struct page *pg;
+
+  for(pg = pcache.hash[phash(dev, inum, pn)]; pg; pg = pg->hnext){
+    if(pg->dev == dev && pg->inum == inum && pg->pn == pn){
+      pg->refcnt++;
+      return pg;
+    }
+  }
+  return 0;
+}
+
+// Return a referenced page for page pn of inode inum on dev.
+// If the page isn't cached, recycle the least recently used
+// unreferenced page; the result then has valid == 0.
+// Returns 0 if every page is in use or no memory is left.
+struct page*
+pget(uint dev, uint inum, uint pn)
+{
+  struct page *pg, *pg1;
+  char *data;
+
+  acquire(&pcache.lock);
+
+  if((pg = plookup(dev, inum, pn)) != 0){
+    release(&pcache.lock);
+    return pg;
+  }
+
+  // Not cached.
+  // Recycle the least recently used unreferenced page.
+  for(pg = pcache.head.prev; pg != &pcache.head; pg = pg->prev){
+    if(pg->refcnt == 0)
+      break;
+  }
+  if(pg == &pcache.head){
+    release(&pcache.lock);
+    return 0;
+  }
+  punhash(pg);
+  pg->refcnt = 1;
+
+  if(pg->data == 0){
+    // kalloc() may call preclaim(), so drop the lock;
+    // the reference keeps pg from being recycled meanwhile.
+    release(&pcache.lock);
+    data = kalloc();
+    acquire(&pcache.lock);
+    if(data == 0){
+      pg->refcnt = 0;
+      release(&pcache.lock);
+      return 0;
+    }
+    if(pg->data)
+      panic("pget");
+    pg->data = data;
+    pcache.pidx[PIDX(data)] = pg - pcache.page + 1;
+    if((pg1 = plookup(dev, inum, pn)) != 0){
+      // someone else cached the page first.
+      pg->refcnt = 0;
+      release(&pcache.lock);
+      return pg1;
+    }
+  }
+
+  pg->dev = dev;
+  pg->inum = inum;
+  pg->pn = pn;
+  pg->valid = 0;
+  pg->hnext = pcache.hash[phash(dev, inum, pn)];
+  pcache.hash[phash(dev, inum, pn)] = pg;
+  release(&pcache.lock);
+  return pg;
+}
+
+// Release a page.
+// Move to the head of the most-recently-used list.
+void
+pput(struct page *pg)
+{
+  acquire(&pcache.lock);
+  if(pg->refcnt < 1)
+    panic("pput");
+  pg->refcnt--;
+  if(pg->refcnt == 0){
+    // no one is waiting for it.
+    pg->next->prev = pg->prev;
+    pg->prev->next = pg->next;
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+    if(!pg->valid)
+      plast(pg);
+  }
+  release(&pcache.lock);
+}
+
+// Increment the reference count of pg.
+void
+pdup(struct page *pg)
+{
+  acquire(&pcache.lock);
+  pg->refcnt++;
+  release(&pcache.lock);
+}
+
+// Return the page whose memory is at physical address pa,
+// or 0 if pa isn't page cache memory.
+struct page*
+pfind(void *pa)
+{
+  int i;
+
+  if((uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP)
+    return 0;
+  acquire(&pcache.lock);
+  i = pcache.pidx[PIDX(pa)];
+  release(&pcache.lock);
+  return i ? &pcache.page[i-1] : 0;
+}
+
+// Is pa page cache memory? Takes no lock, for callers that
+// hold locks that pfind() can't be called with. The answer
+// holds only while pa can't be freed, as when a page table
+// that the caller has locked maps it.
+int
+pcached(void *pa)
+{
+  if((uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP)
+    return 0;
+  return pcache.pidx[PIDX(pa)] != 0;
+}
+
+// Forget all cached pages of inode inum on dev.
+// A page that is still referenced keeps its data
+// until pput(), but can no longer be found.
+void
+pinval(uint dev, uint inum)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+pcache.npage; pg++){
+    if(pg->inum == inum && pg->dev == dev){
+      punhash(pg);
+      if(pg->refcnt == 0)
+        plast(pg);
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Give the memory of the least recently used unreferenced
+// page back to kalloc().
+// Returns 1 if a page was freed, 0 if none could be.
+int
+preclaim(void)
+{
+  struct page *pg;
+  char *data;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.head.prev; pg != &pcache.head; pg = pg->prev){
+    if(pg->refcnt == 0 && pg->data){
+      punhash(pg);
+      plast(pg);
+      data = pg->data;
+      pg->data = 0;
+      pcache.pidx[PIDX(data)] = 0;
+      release(&pcache.lock);
+      kfree(data);
+      return 1;
+    }
+  }
+  release(&pcache.lock);
+  return 0;
+}
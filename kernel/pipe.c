@@ -9,6 +9,9 @@
 #include "file.h"
 
 #define PIPESIZE 512
+#define PIPEBUF 128   // bytes copied to or from the user at once
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
@@ -17,6 +20,7 @@ struct pipe {
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a reader is copying out
 };
 
 int
@@ -28,12 +32,13 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmalloc(sizeof(*pi))) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->reading = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +52,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmfree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,63 +73,94 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmfree(pi);
   } else
     release(&pi->lock);
 }
 
+// Write n bytes from addr to the pipe, a user virtual
+// address if user_src==1, otherwise a kernel address.
+// The bytes are copied in through buf without pi->lock
+// held, since copying from the user may read a page of the
+// program in from disk.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, j, m, k;
+  char buf[PIPEBUF];
   struct proc *pr = myproc();
 
-  acquire(&pi->lock);
   while(i < n){
-    if(pi->readopen == 0 || killed(pr)){
-      release(&pi->lock);
-      return -1;
-    }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    m = min(n - i, PIPEBUF);
+    if(either_copyin(buf, user_src, addr + i, m) == -1)
+      break;
+    acquire(&pi->lock);
+    for(j = 0; j < m; ){
+      if(pi->readopen == 0 || killed(pr)){
+        release(&pi->lock);
+        return -1;
+      }
+      if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+        wakeup(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
+      } else {
+        // copy as much as there is room for before
+        // the end of pi->data.
+        k = min(m - j, PIPESIZE - (pi->nwrite - pi->nread));
+        k = min(k, PIPESIZE - pi->nwrite % PIPESIZE);
+        memmove(&pi->data[pi->nwrite % PIPESIZE], buf + j, k);
+        pi->nwrite += k;
+        j += k;
+      }
     }
+    wakeup(&pi->nread);
+    release(&pi->lock);
+    i += m;
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
 
   return i;
 }
 
+// Read up to n bytes from the pipe to addr, a user virtual
+// address if user_dst==1, otherwise a kernel address.
+// Bytes count as read only once they are copied out, so a
+// bad addr leaves them in the pipe; pi->reading keeps other
+// readers from taking the same bytes meanwhile.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, int user_dst, uint64 addr, int n)
 {
-  int i;
+  int i, m, r;
+  char buf[PIPEBUF];
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->reading || (pi->nread == pi->nwrite && pi->writeopen)){  //DOC: pipe-empty
     if(killed(pr)){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  pi->reading = 1;
+  r = 0;
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - pi->nread % PIPESIZE);
+    m = min(m, PIPEBUF);
+    memmove(buf, &pi->data[pi->nread % PIPESIZE], m);
+    // copy out without the lock, as in pipewrite().
+    release(&pi->lock);
+    r = either_copyout(user_dst, addr + i, buf, m);
+    acquire(&pi->lock);
+    if(r == -1)
       break;
+    pi->nread += m;
   }
+  pi->reading = 0;
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakeup(&pi->nread);   // other readers
   release(&pi->lock);
+  if(r == -1 && i == 0)
+    return -1;
   return i;
 }
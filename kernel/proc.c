@@ -104,10 +104,11 @@ allocpid()
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and, if user is set, a trapframe and an empty user page
+// table, and return with p->lock held.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(int user)
 {
   struct proc *p;
 
@@ -126,15 +127,14 @@ found:
   p->state = USED;
 
   // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+  if(user && (p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
   }
 
   // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  if(user && (p->pagetable = proc_pagetable(p)) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -161,6 +161,9 @@ freeproc(struct proc *p)
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->asid = 0;
+  p->asidgen = 0;
+  p->tlbstale = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -168,6 +171,9 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->exip = 0;
+  memset(p->xseg, 0, sizeof(p->xseg));
   p->state = UNUSED;
 }
 
@@ -188,7 +194,7 @@ proc_pagetable(struct proc *p)
   // only the supervisor uses it, on the way
   // to/from user space, so not PTE_U.
   if(mappages(pagetable, TRAMPOLINE, PGSIZE,
-              (uint64)trampoline, PTE_R | PTE_X) < 0){
+              (uint64)trampoline, PTE_R | PTE_X | PTE_G) < 0){
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -234,7 +240,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(1);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -254,21 +260,68 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread: a process that runs fn() in the
+// kernel, never returns to user space, and never exits. It
+// has no trapframe or user page table.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc(0)) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing allocates no memory; lazyfault() allocates each
+// page when it is first used.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
   uint64 sz;
   struct proc *p = myproc();
+  struct xseg *s;
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(PGROUNDUP(sz + n) > TRAPFRAME)
       return -1;
-    }
+    if(vmaoverlap(p, PGROUNDUP(sz), PGROUNDUP(sz + n)))
+      return -1;
+    sz += n;
   } else if(n < 0){
+    // the heap may end in the middle of a superpage now.
+    if(uvmsplit(p->pagetable, PGROUNDUP(sz + n)) != 0)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // memory that grows back is heap, not program.
+    for(s = p->xseg; s < &p->xseg[NXSEG]; s++){
+      if(s->memsz && s->va + s->memsz > PGROUNDUP(sz)){
+        s->memsz = s->va < PGROUNDUP(sz) ? PGROUNDUP(sz) - s->va : 0;
+        if(s->filesz > s->memsz)
+          s->filesz = s->memsz;
+      }
+    }
   }
   p->sz = sz;
   return 0;
@@ -283,8 +336,11 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // make room for the child's page tables, if memory is short.
+  swapcheck();
+
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(1)) == 0){
     return -1;
   }
 
@@ -296,6 +352,14 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // Copy memory mappings.
+  if(mmapfork(np, p) < 0){
+    munmapall(np);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -307,6 +371,11 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exip){
+    np->exip = idup(p->exip);
+    iexec(np->exip, 1);
+  }
+  memmove(np->xseg, p->xseg, sizeof(p->xseg));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -351,6 +420,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Unmap memory mappings, writing back shared pages.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -362,8 +434,13 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exip){
+    iexec(p->exip, -1);
+    iput(p->exip);
+  }
   end_op();
   p->cwd = 0;
+  p->exip = 0;
 
   acquire(&wait_lock);
 
@@ -391,7 +468,7 @@ int
 wait(uint64 addr)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
@@ -408,12 +485,19 @@ wait(uint64 addr)
         if(pp->state == ZOMBIE){
           // Found one.
           pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
+          xstate = pp->xstate;
+          release(&pp->lock);
+          release(&wait_lock);
+          // copy out with no locks held, since copyout()
+          // may have to read a page of the program in, and
+          // before freeing the child, which stays a zombie
+          // for another wait() if addr is bad. No one else
+          // can free it meanwhile.
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
             return -1;
-          }
+          acquire(&wait_lock);
+          acquire(&pp->lock);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
@@ -472,7 +556,7 @@ scheduler(void)
       }
       release(&p->lock);
     }
-    if(found == 0) {
+    if(found == 0 && kidle() == 0) {
       // nothing to run; stop running on this core until an interrupt.
       intr_on();
       asm volatile("wfi");
@@ -502,9 +586,21 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  // sstatus isn't switched with the process, and no other
+  // process may run with SUM set.
+  if(p->ucopy)
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
+
+  // a copy to or from user memory that was interrupted goes
+  // on through this CPU's user window.
+  if(p->ucopy){
+    uvmwindow(p);
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+  }
 }
 
 // Give up the CPU for one scheduling round.
@@ -594,6 +690,7 @@ wakeup(void *chan)
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
+// Kernel threads never do, and can't be killed.
 int
 kill(int pid)
 {
@@ -601,7 +698,7 @@ kill(int pid)
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
-    if(p->pid == pid){
+    if(p->pid == pid && p->kfn == 0){
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
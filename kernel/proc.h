@@ -24,6 +24,10 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation since the TLB was last flushed
+  pagetable_t pagetable;      // Kernel page table, with the user window
+  int winasid;                // User page table in the window, by its ASID
+  uint64 wingen;              // and the ASID's generation
 };
 
 extern struct cpu cpus[NCPU];
@@ -77,6 +81,28 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 tlbflush;      // no ASIDs: flush the TLB on entry and return
+};
+
+// A memory mapping made by mmap().
+struct vma {
+  uint64 addr;       // page-aligned start; 0 if the slot is free
+  uint64 len;        // page-aligned length
+  int prot;          // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;         // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+  struct file *f;    // mapped file, or 0 if anonymous
+  uint64 off;        // file offset of addr
+};
+
+// A segment of the running program. exec() only records it;
+// lazyfault() reads each page in from the program's inode
+// when it is first used.
+struct xseg {
+  uint64 va;         // page-aligned start; memsz is 0 if the slot is free
+  uint64 memsz;      // bytes of memory
+  uint64 off;        // file offset of va
+  uint64 filesz;     // bytes from the file; the rest are zero
+  int perm;          // PTE_W, PTE_X
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
@@ -99,9 +125,18 @@ struct proc {
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  int asid;                    // Address-space ID of pagetable, if asidgen current
+  uint64 asidgen;              // Generation asid is from, or 0 for none yet
+  uint64 tlbstale;             // CPUs that must flush p's TLB entries
+  int ucopy;                   // Copying through the user window
+  int pinned;                  // Copying through the direct map; see upin()
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Memory mappings
+  struct inode *exip;          // Program file, for xseg
+  struct xseg xseg[NXSEG];     // Program segments
+  void (*kfn)(void);           // If non-zero, kernel thread's function
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,264 @@
+// Allocator for kernel objects smaller than a page.
+//
+// A cache hands out objects of one size. It carves them out
+// of slabs: pages from kalloc() that start with a struct slab
+// and hold as many objects as fit after it. The slab of any
+// object is found by rounding its address down to a page, so
+// kmfree() needs no size or cache. A slab whose objects are
+// all free goes back to kalloc() once the cache has another
+// slab's worth of free objects.
+//
+// Each CPU keeps a few free objects of each cache, so that
+// most allocations and frees take no lock. A CPU that runs out
+// takes half a batch from the slabs; one that has too many
+// gives half back.
+//
+// kcachecreate() makes a cache for one kind of object, such as
+// struct file. kmalloc() serves other requests of up to
+// KMALLOCMAX bytes from caches for a range of size classes.
+// Memory from either is uninitialized.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NKCACHE 16  // caches, counting the size classes
+#define KMAG 16     // free objects each CPU keeps per cache
+
+struct slab {
+  struct kcache *cache;
+  struct slab *next;    // on cache's list of slabs with free objects
+  struct slab *prev;
+  void *free;           // free objects, linked through their first word
+  int nfree;
+};
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+#define KMALLOCMAX (((PGSIZE - SLABHDR) / 2) & ~7)
+
+struct kcache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // object size, a multiple of 8
+  int perslab;          // objects in each slab
+  struct slab *partial; // slabs with free objects
+  int nslab;            // slabs from kalloc()
+  int nfree;            // free objects in the slabs
+  struct {
+    void *obj[KMAG];
+    int n;
+  } cpu[NCPU];          // each CPU's free objects
+};
+
+struct {
+  struct spinlock lock;
+  struct kcache cache[NKCACHE];
+  int n;
+} kcaches;
+
+static uint kmsize[] = { 16, 32, 64, 128, 256, 512, 1024, KMALLOCMAX };
+#define NKMSIZE (sizeof(kmsize) / sizeof(kmsize[0]))
+static struct kcache *kmcache[NKMSIZE];
+
+void
+kmallocinit(void)
+{
+  int i;
+
+  initlock(&kcaches.lock, "kcaches");
+  for(i = 0; i < NKMSIZE; i++)
+    kmcache[i] = kcachecreate("kmalloc", kmsize[i]);
+}
+
+// Make a cache for objects of size bytes.
+// Panics if size is over KMALLOCMAX or there are too many caches.
+struct kcache*
+kcachecreate(char *name, uint size)
+{
+  struct kcache *c;
+
+  if(size > KMALLOCMAX)
+    panic("kcachecreate: too big");
+  acquire(&kcaches.lock);
+  if(kcaches.n == NKCACHE)
+    panic("kcachecreate: too many");
+  c = &kcaches.cache[kcaches.n++];
+  release(&kcaches.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  if(c->size < sizeof(void*))
+    c->size = sizeof(void*);
+  c->perslab = (PGSIZE - SLABHDR) / c->size;
+  return c;
+}
+
+// Get a page from kalloc() and make it a slab of c.
+// Caller must hold c->lock.
+static struct slab*
+slabgrow(struct kcache *c)
+{
+  struct slab *s;
+  char *o;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  for(i = c->perslab - 1; i >= 0; i--){
+    o = (char*)s + SLABHDR + i * c->size;
+    *(void**)o = s->free;
+    s->free = o;
+  }
+  s->nfree = c->perslab;
+  s->prev = 0;
+  s->next = c->partial;
+  if(s->next)
+    s->next->prev = s;
+  c->partial = s;
+  c->nslab++;
+  c->nfree += c->perslab;
+  return s;
+}
+
+static void
+slabunlink(struct kcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Move free objects from c's slabs to this CPU's list, to
+// half full. Caller must have interrupts off.
+static void
+kcacherefill(struct kcache *c, int id)
+{
+  struct slab *s;
+  void *o;
+
+  acquire(&c->lock);
+  while(c->cpu[id].n < KMAG/2){
+    if((s = c->partial) == 0 && (s = slabgrow(c)) == 0)
+      break;
+    o = s->free;
+    s->free = *(void**)o;
+    s->nfree--;
+    c->nfree--;
+    if(s->nfree == 0)
+      slabunlink(c, s);
+    c->cpu[id].obj[c->cpu[id].n++] = o;
+  }
+  release(&c->lock);
+}
+
+// Move n objects from this CPU's list back to their slabs.
+// Caller must have interrupts off.
+static void
+kcachedrain(struct kcache *c, int id, int n)
+{
+  struct slab *s;
+  void *o;
+
+  acquire(&c->lock);
+  while(n-- > 0 && c->cpu[id].n > 0){
+    o = c->cpu[id].obj[--c->cpu[id].n];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    *(void**)o = s->free;
+    s->free = o;
+    s->nfree++;
+    c->nfree++;
+    if(s->nfree == 1){
+      // it was full.
+      s->prev = 0;
+      s->next = c->partial;
+      if(s->next)
+        s->next->prev = s;
+      c->partial = s;
+    }
+    if(s->nfree == c->perslab && c->nfree >= 2 * c->perslab){
+      slabunlink(c, s);
+      c->nslab--;
+      c->nfree -= c->perslab;
+      kfree(s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kcachealloc(struct kcache *c)
+{
+  void *o;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(c->cpu[id].n == 0)
+    kcacherefill(c, id);
+  o = 0;
+  if(c->cpu[id].n > 0)
+    o = c->cpu[id].obj[--c->cpu[id].n];
+  pop_off();
+  return o;
+}
+
+// Allocate n bytes, for n up to KMALLOCMAX.
+// Returns 0 if n is too big or the memory cannot be allocated.
+void*
+kmalloc(uint n)
+{
+  int i;
+
+  for(i = 0; i < NKMSIZE; i++)
+    if(n <= kmsize[i])
+      return kcachealloc(kmcache[i]);
+  return 0;
+}
+
+// Free an object from kmalloc() or kcachealloc().
+void
+kmfree(void *o)
+{
+  struct kcache *c;
+  int id;
+
+  if((uint64)o % 8 || (uint64)o < KERNBASE || (uint64)o >= PHYSTOP)
+    panic("kmfree");
+  c = ((struct slab*)PGROUNDDOWN((uint64)o))->cache;
+
+#ifdef KDEBUG
+  // Fill with junk to catch dangling refs.
+  memset(o, 1, c->size);
+#endif
+
+  push_off();
+  id = cpuid();
+  if(c->cpu[id].n == KMAG)
+    kcachedrain(c, id, KMAG/2);
+  c->cpu[id].obj[c->cpu[id].n++] = o;
+  pop_off();
+}
+
+// Print each cache's slab counts, for ^P on the console.
+// Takes no locks.
+void
+kmallocdump(void)
+{
+  struct kcache *c;
+
+  for(c = kcaches.cache; c < &kcaches.cache[kcaches.n]; c++){
+    if(c->nslab)
+      printf("%s %d: %d slabs %d free\n", c->name, c->size, c->nslab, c->nfree);
+  }
+}
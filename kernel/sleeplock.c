@@ -15,6 +15,7 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->nshared = 0;
   lk->pid = 0;
 }
 
@@ -22,7 +23,7 @@ void
 acquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
+  while (lk->locked || lk->nshared) {
     sleep(lk, &lk->lk);
   }
   lk->locked = 1;
@@ -40,6 +41,34 @@ releasesleep(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+// Shared mode: any number of processes can hold lk with
+// acquiresleepshared() at once, but not while a process holds
+// it with acquiresleep(). Readers don't wait for a waiting
+// writer, so a process that holds lk shared can acquire it
+// shared again without deadlock, but a steady stream of
+// readers can hold off a writer.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->locked) {
+    sleep(lk, &lk->lk);
+  }
+  lk->nshared++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->nshared < 1)
+    panic("releasesleepshared");
+  if(--lk->nshared == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -1,6 +1,7 @@
 // Long-term locks for processes
 struct sleeplock {
   uint locked;       // Is the lock held?
+  uint nshared;      // Number of holders in shared mode
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
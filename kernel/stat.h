@@ -9,3 +9,12 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// A directory entry from getdents(). st.ino is always set;
+// the rest of st only with GD_STAT, and is zero otherwise.
+struct dirstat {
+  struct stat st;
+  char name[15];  // DIRSIZ bytes and a NUL
+};
+
+#define GD_STAT   0x1   // getdents() flag: fill in dirstat.st
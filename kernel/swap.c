@@ -0,0 +1,246 @@
+// Swapping of user memory to disk.
+//
+// When little memory is free, swapout() writes pages of user
+// memory to the swap area that mkfs leaves after the file
+// system, and frees them. A clock hand sweeps each process's
+// program and heap pages in turn; a page used since the hand
+// last passed it gets a second chance, as the hand clears its
+// accessed bit and moves on. A page that is written out keeps
+// its PTE flags, with PTE_V clear and PTE_SWAP set, and its
+// swap slot in place of the physical page number; a fault on
+// it reads it back in with swapin().
+//
+// Only pages that nothing else shares are swapped out: not
+// pages of the page cache, pages shared copy-on-write since
+// fork, or superpages. A slot can be shared, though, when a
+// process with pages swapped out forks.
+//
+// Reclaiming means waiting for the disk, so it isn't done
+// inside kalloc(), which is called with spinlocks held; the
+// kernel calls swapcheck() instead at points where the current
+// process may sleep and is about to need memory: page faults,
+// fork() and exec().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "defs.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)  // disk blocks per slot
+#define NSLOT (NSWAP / SLOTBLOCKS)
+#define SWAPLOW 256    // reclaim when fewer pages are free
+#define SWAPBATCH 32   // pages to reclaim at a time
+#define SWAPSCAN 1024  // pages to look at with one p->lock
+
+extern struct proc proc[NPROC];
+
+struct {
+  struct spinlock lock;
+  uint start;          // first block of the swap area
+  int nslot;           // 0 if there is no swap area
+  int next;            // where slotalloc() looks first
+  ushort ref[NSLOT];   // PTEs that hold each slot
+  char busy[NSLOT];    // being written by swapout()
+
+  // held by the one process reclaiming, for the clock hand:
+  struct sleeplock swapper;
+  int hand;            // the process,
+  uint64 va;           // and the page in it
+} swap;
+
+// Called by fsinit() with the swap area from the superblock.
+void
+swapinit(uint start, uint nblocks)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.swapper, "swapper");
+  swap.start = start;
+  swap.nslot = nblocks / SLOTBLOCKS;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+}
+
+// Allocate up to n free slots, busy and with one reference,
+// into slot[]. Returns how many.
+static int
+slotalloc(int *slot, int n)
+{
+  int i, k = 0;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot && k < n; i++){
+    if(swap.ref[swap.next] == 0 && !swap.busy[swap.next]){
+      swap.ref[swap.next] = 1;
+      swap.busy[swap.next] = 1;
+      slot[k++] = swap.next;
+    }
+    swap.next = (swap.next + 1) % swap.nslot;
+  }
+  release(&swap.lock);
+  return k;
+}
+
+// Another PTE holds slot, as fork() copies a page table.
+void
+swapdup(int slot)
+{
+  acquire(&swap.lock);
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// A PTE no longer holds slot. Called with p->lock held from
+// freeproc(), so it must not sleep or wake anyone.
+void
+swapfree(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 0)
+    panic("swapfree");
+  swap.ref[slot]--;
+  release(&swap.lock);
+}
+
+// Can the current process wait for the disk? Not if a page
+// fault came while it holds a spinlock.
+static int
+cansleep(void)
+{
+  int spinning;
+
+  push_off();
+  spinning = mycpu()->noff > 1;
+  pop_off();
+  return myproc() != 0 && !spinning;
+}
+
+static int
+slotbusy(int slot)
+{
+  int busy;
+
+  acquire(&swap.lock);
+  busy = swap.busy[slot];
+  release(&swap.lock);
+  return busy;
+}
+
+// Write up to n pages of user memory to swap, and free them.
+// Pages of the current process can go too. Returns how many
+// pages were freed, 0 if the caller can't sleep.
+int
+swapout(int n)
+{
+  struct proc *p, *me = myproc();
+  int slot[SWAPBATCH];
+  pte_t *ptes[SWAPBATCH];
+  uint64 pa[SWAPBATCH], end;
+  int i, k, nslot, nout, laps, ok;
+
+  if(swap.nslot == 0 || !cansleep())
+    return 0;
+  if(n > SWAPBATCH)
+    n = SWAPBATCH;
+  acquiresleep(&swap.swapper);
+  nslot = slotalloc(slot, n);
+  nout = 0;
+  // two laps give every page its second chance.
+  for(laps = 0; nout < nslot && laps < 2*NPROC; ){
+    p = &proc[swap.hand];
+    acquire(&p->lock);
+    // not a process stopped in a copy through the direct
+    // map; see upin().
+    ok = (p == me ||
+          ((p->state == SLEEPING || p->state == RUNNABLE) && !p->pinned)) &&
+      p->pagetable && swap.va < p->sz;
+    if(ok){
+      end = swap.va + SWAPSCAN*PGSIZE;
+      if(end > p->sz)
+        end = p->sz;
+      k = uvmswapscan(p->pagetable, &swap.va, end, ptes, nslot - nout);
+      for(i = 0; i < k; i++, nout++){
+        pa[nout] = PTE2PA(*ptes[i]);
+        *ptes[i] = SLOT2PTE(slot[nout]) | (PTE_FLAGS(*ptes[i]) & ~PTE_V) | PTE_SWAP;
+      }
+      // pages are gone and accessed bits clear: p's
+      // TLB entries are stale everywhere.
+      if(p == me)
+        uvmflush(p->pagetable, -1);
+      else
+        p->tlbstale = ~0L;
+    }
+    if(!ok || swap.va >= p->sz){
+      swap.hand = (swap.hand + 1) % NPROC;
+      swap.va = 0;
+      laps++;
+    }
+    release(&p->lock);
+  }
+
+  for(i = 0; i < nout; i++)
+    virtio_disk_page(swap.start + slot[i]*SLOTBLOCKS, (void*)pa[i], 1);
+  acquire(&swap.lock);
+  for(i = 0; i < nslot; i++){
+    if(i >= nout)
+      swap.ref[slot[i]] = 0;
+    swap.busy[slot[i]] = 0;
+  }
+  release(&swap.lock);
+  releasesleep(&swap.swapper);
+
+  for(i = 0; i < nout; i++)
+    kfree((void*)pa[i]);
+  return nout;
+}
+
+// Reclaim memory if little is free. Called where the current
+// process may sleep, before it needs memory.
+void
+swapcheck(void)
+{
+  if(swap.nslot > 0 && kfreecount() < SWAPLOW)
+    swapout(SWAPBATCH);
+}
+
+// Read the swapped-out page whose PTE in the current process's
+// page table is pte back into memory, and map it again. The
+// caller flushes the TLB.
+// Returns the page's physical address, or 0 if there is no
+// memory, or a spinlock is held so that there is no waiting
+// for the disk.
+uint64
+swapin(pte_t *pte)
+{
+  char *mem;
+  int slot, flags;
+
+  if(!cansleep())
+    return 0;
+
+  slot = PTE2SLOT(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_SWAP;
+  if((mem = kalloc()) == 0){
+    swapout(SWAPBATCH);
+    if((mem = kalloc()) == 0)
+      return 0;
+  }
+  // a write of the slot may still be going on; the swapper
+  // holds swap.swapper until it's done.
+  while(slotbusy(slot)){
+    acquiresleep(&swap.swapper);
+    releasesleep(&swap.swapper);
+  }
+  virtio_disk_page(swap.start + slot*SLOTBLOCKS, mem, 0);
+
+  // the copy is this page table's alone.
+  if(flags & PTE_COW)
+    flags = (flags & ~PTE_COW) | PTE_W;
+  *pte = PA2PTE(mem) | flags | PTE_V | PTE_A;
+  swapfree(slot);
+  return (uint64)mem;
+}
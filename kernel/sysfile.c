@@ -94,6 +94,138 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Fetch the iovcnt-long struct iovec array at user address
+// uiov into iov.
+static int
+argiov(uint64 uiov, int iovcnt, struct iovec *iov)
+{
+  uint64 tot = 0;
+  int i;
+
+  if(iovcnt < 0 || iovcnt > NIOV)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)iov, uiov, iovcnt*sizeof(struct iovec)) < 0)
+    return -1;
+  // the total has to fit in the int result.
+  for(i = 0; i < iovcnt; i++)
+    if((tot += iov[i].iov_len) > 0x7fffffff)
+      return -1;
+  return 0;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[NIOV];
+  uint64 uiov;
+  int iovcnt, i, r, tot;
+
+  argaddr(1, &uiov);
+  argint(2, &iovcnt);
+  if(argfd(0, 0, &f) < 0 || argiov(uiov, iovcnt, iov) < 0)
+    return -1;
+
+  tot = 0;
+  for(i = 0; i < iovcnt; i++){
+    r = fileread(f, (uint64)iov[i].iov_base, iov[i].iov_len);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    // don't wait for more from a pipe or device.
+    if(r < iov[i].iov_len || (f->type != FD_INODE && r > 0))
+      break;
+  }
+  return tot;
+}
+
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[NIOV];
+  uint64 uiov;
+  int iovcnt, i, r, tot;
+
+  argaddr(1, &uiov);
+  argint(2, &iovcnt);
+  if(argfd(0, 0, &f) < 0 || argiov(uiov, iovcnt, iov) < 0)
+    return -1;
+
+  tot = 0;
+  for(i = 0; i < iovcnt; i++){
+    r = filewrite(f, (uint64)iov[i].iov_base, iov[i].iov_len);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if(r < iov[i].iov_len)
+      break;
+  }
+  return tot;
+}
+
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || off < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || off < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+// Read many directory entries at once, optionally
+// with their stat: getdents(fd, dirstat[], n, flags).
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  int n, flags;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &flags);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filegetdents(f, p, n, flags);
+}
+
+// Give a file disk blocks up front:
+// fallocate(fd, off, len).
+uint64
+sys_fallocate(void)
+{
+  struct file *f;
+  int off, len;
+
+  argint(1, &off);
+  argint(2, &len);
+  if(argfd(0, 0, &f) < 0 || off < 0 || len < 0)
+    return -1;
+  return fileallocate(f, off, len);
+}
+
 uint64
 sys_close(void)
 {
@@ -305,7 +437,7 @@ uint64
 sys_open(void)
 {
   char path[MAXPATH];
-  int fd, omode;
+  int fd, omode, w;
   struct file *f;
   struct inode *ip;
   int n;
@@ -341,9 +473,19 @@ sys_open(void)
     return -1;
   }
 
+  w = ip->type != T_DEVICE && (omode & (O_WRONLY|O_RDWR|O_TRUNC));
+  if(w && iwriter(ip, 1) < 0){
+    // a running program; see iexec().
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
+    if(w)
+      iwriter(ip, -1);
     iunlockput(ip);
     end_op();
     return -1;
@@ -363,6 +505,8 @@ sys_open(void)
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
   }
+  if(w && !f->writable)
+    iwriter(ip, -1);  // O_TRUNC only; fileclose() won't count it
 
   iunlock(ip);
   end_op();
@@ -503,3 +647,44 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Move n bytes from one open file to another
+// inside the kernel: sendfile(outfd, infd, n).
+uint64
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int n;
+
+  argint(2, &n);
+  if(argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 || n < 0)
+    return -1;
+  return filesend(out, in, n);
+}
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags;
+  struct file *f = 0;
+
+  argaddr(0, &addr);  // only a hint, and ignored
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
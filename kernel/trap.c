@@ -29,6 +29,34 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// handle a page fault from user space at address va, of
+// exception cause scause. returns 1 if the process can go
+// on, 0 if it isn't a page fault or va can't be used.
+static int
+pagefault(struct proc *p, uint64 scause, uint64 va)
+{
+  int write;
+
+  if(scause == 12)
+    write = FAULT_EXEC;  // instruction fetch
+  else if(scause == 13 || scause == 15)
+    write = scause == 15;
+  else
+    return 0;
+
+  // free some memory by swapping, if little is left, while
+  // nothing is half done.
+  swapcheck();
+
+  if(scause == 15 && cowfault(p->pagetable, va) != 0)
+    return 1;  // write to a page shared since fork
+  if(lazyfault(p->pagetable, va, write) != 0)
+    return 1;  // first use of a program or heap page, or one swapped out
+  if(mmapfault(p->pagetable, va, write) != 0)
+    return 1;  // page fault in an mmap()ed region
+  return 0;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -67,6 +95,8 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(pagefault(p, r_scause(), r_stval())){
+    // ok
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -119,8 +149,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // and its address-space ID.
+  uint64 satp = uvmsatp(p);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -129,6 +160,36 @@ usertrapret(void)
   ((void (*)(uint64))trampoline_userret)(satp);
 }
 
+// the exception-fixup table: a page fault in one of the
+// user-copy routines in usercopy.S that can't be handled
+// goes on at fixup.
+extern char ucopybytes[], ucopybytes_end[];
+extern char ucopystr[], ucopystr_end[];
+extern char ucopyfail[];
+
+static struct {
+  char *start;
+  char *end;
+  char *fixup;
+} fixups[] = {
+  { ucopybytes, ucopybytes_end, ucopyfail },
+  { ucopystr, ucopystr_end, ucopyfail },
+};
+
+#define NFIXUP (sizeof(fixups) / sizeof(fixups[0]))
+
+// the fixup for a fault at pc, or 0.
+static uint64
+fixup(uint64 pc)
+{
+  int i;
+
+  for(i = 0; i < NFIXUP; i++)
+    if(pc >= (uint64)fixups[i].start && pc < (uint64)fixups[i].end)
+      return (uint64)fixups[i].fixup;
+  return 0;
+}
+
 // interrupts and exceptions from kernel code go here via kernelvec,
 // on whatever the current kernel stack is.
 void 
@@ -138,13 +199,24 @@ kerneltrap()
   uint64 sepc = r_sepc();
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
+  uint64 stval = r_stval();
+  uint64 fix;
   
   if((sstatus & SSTATUS_SPP) == 0)
     panic("kerneltrap: not from supervisor mode");
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) && (fix = fixup(sepc)) != 0){
+    // a page fault copying to or from user memory: perhaps
+    // a page not mapped yet, or shared since fork. this may
+    // sleep to read the page in.
+    if(sstatus & SSTATUS_SPIE)
+      intr_on();
+    if(uvmwindowfault(stval, scause == 15) == 0)
+      sepc = fix;
+    intr_off();
+  } else if((which_dev = devintr()) == 0){
     // interrupt or trap from an unknown source
     printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
     panic("kerneltrap");
@@ -3,6 +3,10 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "page.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,6 +15,28 @@
  */
 pagetable_t kernel_pagetable;
 
+// Address-space IDs. The TLB tags each entry with the ASID in
+// satp when it was loaded, so a process with an ASID of its
+// own keeps its entries across traps and context switches.
+// The kernel's page table is ASID 0; only the trampoline,
+// mapped the same in every page table, is global. ASIDs are
+// handed out in order, never reused within a generation;
+// when they run out, a new generation starts, each CPU
+// flushes its whole TLB before it next enters user space, and
+// each process gets a new ASID when it next does.
+struct {
+  struct spinlock lock;
+  uint64 gen;   // generation, from 1
+  int next;     // next ASID of this generation
+  int max;      // largest ASID the hardware has, or 0
+} asids;
+
+// uvmunmap() flushes the TLB by ASID, rather than page by
+// page, when it removes more pages than this.
+#define NFLUSH 32
+
+static pte_t *walklevel(pagetable_t, uint64, int, int *);
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -21,8 +47,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -41,7 +66,8 @@ kvmmake(void)
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
-  kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+  // every user page table maps it the same way.
+  kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X | PTE_G);
 
   // allocate and map a kernel stack for each process.
   proc_mapstacks(kpgtbl);
@@ -54,22 +80,240 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asids.lock, "asids");
+  asids.gen = 1;
+  asids.next = 1;
 }
 
-// Switch h/w page table register to the kernel's page table,
-// and enable paging.
+// Switch h/w page table register to this CPU's copy of the
+// kernel's page table, and enable paging. The copies differ
+// only in their user windows, and share all page-table pages
+// but the root.
 void
 kvminithart()
 {
+  struct cpu *c = mycpu();
+
+  if((c->pagetable = (pagetable_t)kalloc()) == 0)
+    panic("kvminithart");
+  memmove(c->pagetable, kernel_pagetable, PGSIZE);
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(c->pagetable));
+
+  if(cpuid() == 0){
+    // the ASID bits that the hardware has read back as ones.
+    w_satp(MAKE_SATP_ASID(c->pagetable, SATP_ASID_MASK));
+    asids.max = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    w_satp(MAKE_SATP(c->pagetable));
+  }
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Return the satp value for switching to p's page table, for
+// usertrapret(). Gives p an ASID of the current generation if
+// it has none, and first flushes whatever this CPU's TLB may
+// hold that p mustn't use. Without ASIDs, user and kernel
+// entries share ASID 0, and user addresses overlap the
+// kernel's, so p->trapframe->tlbflush has trampoline.S flush
+// the TLB after each switch of page table too. Called with
+// interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen, me = 1L << cpuid();
+
+  if(asids.max == 0){
+    // no ASIDs: every address space is ASID 0.
+    sfence_vma();
+    p->trapframe->tlbflush = 1;
+    return MAKE_SATP(p->pagetable);
+  }
+  p->trapframe->tlbflush = 0;
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if(p->asidgen != gen){
+    acquire(&asids.lock);
+    if(asids.next > asids.max){
+      __atomic_store_n(&asids.gen, asids.gen + 1, __ATOMIC_RELEASE);
+      asids.next = 1;
+    }
+    gen = asids.gen;
+    p->asid = asids.next++;
+    release(&asids.lock);
+    // no CPU has used this ASID since it last flushed.
+    p->asidgen = gen;
+    p->tlbstale = 0;
+  }
+
+  if(c->asidgen != gen){
+    // this CPU may hold entries for ASIDs of an older
+    // generation, which a process may now have again.
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->tlbstale & me){
+    sfence_vma_asid(p->asid);
+    sfence_vma_asid(0);  // the user window's entries
+  }
+  p->tlbstale &= ~me;
+  return MAKE_SATP_ASID(p->pagetable, p->asid);
+}
+
+// Does this CPU's user window show p's page table?
+static int
+inwindow(struct proc *p)
+{
+  struct cpu *c = mycpu();
+
+  return c->winasid == p->asid && c->wingen == p->asidgen;
+}
+
+// Make this CPU's user window show p's memory, and flush what
+// the TLB may hold of it that is stale. Called with
+// interrupts off.
+void
+uvmwindow(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 me = 1L << cpuid();
+
+  if(!inwindow(p)){
+    memmove(&c->pagetable[PX(2, UWINDOW)], p->pagetable, 256*sizeof(pte_t));
+    c->winasid = p->asid;
+    c->wingen = p->asidgen;
+    sfence_vma_asid(0);
+  } else if(p->tlbstale & me){
+    sfence_vma_asid(0);
+  } else {
+    return;
+  }
+  if(p->tlbstale & me){
+    sfence_vma_asid(p->asid);
+    p->tlbstale &= ~me;
+  }
+}
+
+// Does the PTE for user address va in pagetable allow a write,
+// if write is set, or else a read, from the user window? If so,
+// set its A and D bits, which the hardware may leave to us,
+// and flush its stale TLB entries.
+static int
+uvmwindowok(pagetable_t pagetable, uint64 va, int write)
+{
+  pte_t *pte;
+  uint64 need = PTE_V | PTE_U | (write ? PTE_W : PTE_R);
+
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & need) != need)
+    return 0;
+  *pte |= PTE_A | (write ? PTE_D : 0);
+  uvmflush(pagetable, va);
+  return 1;
+}
+
+// Handle a page fault at address addr in the user window, for
+// a write if write is set, while copying to or from the current
+// process's memory: map the page as usertrap() would.
+// Returns 1 if the copy can go on, or 0 if addr isn't an
+// address the process may read, or write.
+int
+uvmwindowfault(uint64 addr, int write)
+{
+  struct proc *p = myproc();
+  struct cpu *c;
+  uint64 va;
+  int i;
+
+  if(p == 0 || !p->ucopy || addr < UWINDOW || addr - UWINDOW >= TRAPFRAME)
+    return 0;
+  va = PGROUNDDOWN(addr - UWINDOW);
+
+  // a page-table page the process has had since this CPU
+  // last set its window.
+  push_off();
+  c = mycpu();
+  i = PX(2, va);
+  if(inwindow(p) && c->pagetable[PX(2, UWINDOW) + i] != p->pagetable[i]){
+    c->pagetable[PX(2, UWINDOW) + i] = p->pagetable[i];
+    sfence_vma_asid(0);
+    pop_off();
+    return 1;
+  }
+  pop_off();
+
+  if(uvmwindowok(p->pagetable, va, write))
+    return 1;
+  if(write && cowfault(p->pagetable, va) == 0 &&
+     lazyfault(p->pagetable, va, 1) == 0 && mmapfault(p->pagetable, va, 1) == 0)
+    return 0;
+  if(!write && lazyfault(p->pagetable, va, 0) == 0 &&
+     mmapfault(p->pagetable, va, 0) == 0)
+    return 0;
+  return uvmwindowok(p->pagetable, va, write);
+}
+
+// Map the current process's pages in [va, va+len), for writing
+// if write is set, by handling the faults that using them
+// would cause. For a caller about to copy to or from them with
+// an inode locked: a fault in a mapping of another file would
+// wait for that file's lock, whose holder may be waiting for
+// the caller's. Pages that can't be used are left for the
+// copy to fail on.
+void
+uvmfaultin(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a, need;
+  pte_t *pte;
+
+  if(len == 0 || va + len < va || va + len > MAXVA)
+    return;
+  need = PTE_V | PTE_U | (write ? PTE_W : PTE_R);
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) != 0 && (*pte & need) == need)
+      continue;
+    if(write && cowfault(p->pagetable, a) != 0)
+      continue;
+    if(lazyfault(p->pagetable, a, write) == 0)
+      mmapfault(p->pagetable, a, write);
+  }
+}
+
+// Flush the TLB entry for user virtual address va, or all
+// entries if va is -1, of pagetable after a change to its
+// PTEs, both as a user address and in the user window: on
+// this CPU now, and on other CPUs when the process next
+// returns to user space or copies through the window there. Only the current
+// process's page table can have entries to flush.
+void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable || p->asidgen == 0)
+    return;
+  if(asids.max == 0){
+    sfence_vma();
+    return;
+  }
+  push_off();
+  if(va == -1){
+    sfence_vma_asid(p->asid);
+    if(inwindow(p))
+      sfence_vma_asid(0);
+  } else {
+    sfence_vma_page(va, p->asid);
+    if(inwindow(p))
+      sfence_vma_page(UWINDOW + va, 0);
+  }
+  p->tlbstale |= ~(1L << cpuid());
+  pop_off();
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,24 +326,68 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE at level 1 maps a 2-megabyte superpage. If a
+// superpage maps va, walk() returns its level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but return the PTE at level *level: 0 for a
+// page, 1 for a superpage. If a superpage at a higher level
+// maps va, return its PTE instead, and set *level to its level.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
+}
+
+// The physical address of the page at va, given the leaf PTE
+// at level that maps it.
+static uint64
+pteaddr(pte_t *pte, int level, uint64 va)
+{
+  return PTE2PA(*pte) + (PGROUNDDOWN(va) & ((1L << PXSHIFT(level)) - 1));
+}
+
+// Split the superpage mapped by pte into a page-table page of
+// PTEs for its pages, with the same flags.
+// Returns 0, or -1 if there is no memory for the page table.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa;
+  int i;
+
+  if((pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  for(i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -110,18 +398,19 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(pte, level, va);
   return pa;
 }
 
@@ -138,13 +427,16 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
+// Each 2-megabyte stretch where va and pa are both aligned to
+// a superpage, and nothing is mapped yet, gets a superpage.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, n;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("mappages: va not aligned");
@@ -158,44 +450,119 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    level = 0;
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      level = 1;
+      if((pte = walklevel(pagetable, a, 1, &level)) == 0)
+        return -1;
+      if((*pte & PTE_V) && !PTE_LEAF(*pte))
+        level = 0;  // some pages here have a page table already
+    }
+    if(level == 0 && (pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    n = level ? SUPERPGSIZE : PGSIZE;
+    if(a + n - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += n;
+    pa += n;
   }
   return 0;
 }
 
+// Drop a user mapping's hold on the page at pa: a page of
+// the page cache goes back to the cache, any other page to
+// kfree().
+static void
+uvmput(uint64 pa)
+{
+  struct page *pg;
+
+  if((pg = pfind((void*)pa)) != 0)
+    pput(pg);
+  else
+    kfree((void*)pa);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped, such as heap
+// pages not yet touched, are skipped; swapped-out pages give
+// up their swap slots. A superpage must be
+// removed whole; uvmsplit() splits one that isn't.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end, off;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
+    if(*pte == PTE_GUARD){
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    if(level > 0){
+      if(a % SUPERPGSIZE || end - a < SUPERPGSIZE)
+        panic("uvmunmap: part of a superpage");
+      // superpages come from kalloc_pages(), never the page cache.
+      if(do_free)
+        for(off = 0; off < SUPERPGSIZE; off += PGSIZE)
+          kfree((void*)(PTE2PA(*pte) + off));
+      *pte = 0;
+      if(npages <= NFLUSH)
+        uvmflush(pagetable, a);
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
     }
+    if(do_free)
+      uvmput(PTE2PA(*pte));
     *pte = 0;
+    if(npages <= NFLUSH)
+      uvmflush(pagetable, a);
   }
+  if(npages > NFLUSH)
+    uvmflush(pagetable, -1);
+}
+
+// Split the superpage, if any, that maps va but starts below
+// it, so that the pages from va up can be unmapped.
+// Returns 0, or -1 if there is no memory for the split.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int level = 0;
+
+  if(va >= MAXVA || va % SUPERPGSIZE == 0)
+    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level == 0)
+    return 0;
+  if(demote(pte) != 0)
+    return -1;
+  uvmflush(pagetable, va);
+  return 0;
 }
 
 // create an empty user page table.
@@ -204,10 +571,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,33 +587,41 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Each aligned 2 megabytes of the new memory gets a superpage,
+// if there is a free block that size.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
   char *mem;
-  uint64 a;
+  uint64 a, n;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
-  for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+  for(a = oldsz; a < newsz; a += n){
+    n = PGSIZE;
+    mem = 0;
+    if(a % SUPERPGSIZE == 0 && newsz - a >= SUPERPGSIZE &&
+       (mem = kalloc_pages(SUPERORDER)) != 0){
+      n = SUPERPGSIZE;
+      memset(mem, 0, n);
+    } else {
+      mem = kalloc_zeroed();
+    }
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
-      kfree(mem);
+    if(mappages(pagetable, a, n, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+      kfree_pages(mem, n == PGSIZE ? 0 : SUPERORDER);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
@@ -305,33 +679,66 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: the child shares each
+// physical page with the parent. Writable pages become
+// read-only and copy-on-write in both; cowfault() copies
+// such a page when either writes it. Program text from the
+// page cache is read-only already. A superpage is shared
+// whole, as a superpage, and a swapped-out page shares its
+// swap slot.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  pte_t *pte, *npte;
+  uint64 pa, i, n, off;
   uint flags;
-  char *mem;
+  struct page *pg;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = 0; i < sz; i += n){
+    n = PGSIZE;
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      // both share the swap slot until each reads it in.
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      swapdup(PTE2SLOT(*pte));
+      *npte = *pte;
+      continue;
+    }
+    if(*pte == PTE_GUARD){
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = PTE_GUARD;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;  // a heap page not touched yet
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    flags = PTE_FLAGS(*pte) & ~PTE_D;
+    if(level > 0){
+      n = SUPERPGSIZE;
+      for(off = 0; off < n; off += PGSIZE)
+        kdup((void*)(pa + off));
+    } else if((pg = pfind((void*)pa)) != 0)
+      pdup(pg);
+    else
+      kdup((void*)pa);
+    if(mappages(new, i, n, pa, flags) != 0){
+      for(off = 0; off < n; off += PGSIZE)
+        uvmput(pa + off);
+      uvmflush(old, -1);
       goto err;
     }
   }
+  // the parent's writable pages are read-only now.
+  uvmflush(old, -1);
   return 0;
 
  err:
@@ -339,17 +746,265 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Find pages of user memory in pagetable for swapout() to
+// write to swap, from *va up to end: 4K pages that no other
+// page table or the page cache shares. A page used since the
+// last look gets a second chance instead, as its accessed bit
+// is cleared. So does a superpage; one that wasn't used is
+// split, so that its pages can go one at a time.
+// Puts the PTEs of up to n pages in ptes[], and returns how
+// many; advances *va past the pages looked at.
+// The caller holds the lock of the process that owns
+// pagetable, which isn't running, or is the caller.
+int
+uvmswapscan(pagetable_t pagetable, uint64 *va, uint64 end, pte_t **ptes, int n)
+{
+  uint64 a, pa;
+  pte_t *pte;
+  int k = 0, level;
+
+  for(a = *va; a < end && k < n; a += PGSIZE){
+    level = 0;
+    pte = walklevel(pagetable, a, 0, &level);
+    if(pte && level > 0){
+      // a superpage gets its second chance whole, and is
+      // split once it wasn't used.
+      if((*pte & PTE_A) || kowners((void*)PTE2PA(*pte)) > 1 || demote(pte) != 0){
+        *pte &= ~PTE_A;
+        a = SUPERPGROUNDDOWN(a) + SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      pte = walk(pagetable, a, 0);
+    }
+    if(pte == 0){
+      // no page-table page here.
+      a = SUPERPGROUNDDOWN(a) + SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      continue;
+    }
+    pa = PTE2PA(*pte);
+    if(kowners((void*)pa) > 1 || pcached((void*)pa))
+      continue;
+    ptes[k++] = pte;
+  }
+  *va = a;
+  return k;
+}
+
+// Give the heap around user virtual address va of p a whole
+// superpage of zeros at once, if the superpage lies in the
+// heap, below p->sz and above the program, with nothing of
+// it mapped yet, and there is a free block that size.
+// Returns the physical address now mapped at va, or 0.
+static uint64
+lazysuper(struct proc *p, uint64 va)
+{
+  uint64 base = SUPERPGROUNDDOWN(va);
+  struct xseg *s;
+  pte_t *pte;
+  char *mem;
+  int level = 1;
+
+  if(base + SUPERPGSIZE > p->sz)
+    return 0;
+  for(s = p->xseg; s < &p->xseg[NXSEG]; s++)
+    if(s->memsz && s->va < base + SUPERPGSIZE && s->va + s->memsz > base)
+      return 0;
+  if((pte = walklevel(p->pagetable, base, 0, &level)) != 0 && (*pte & PTE_V))
+    return 0;
+  if((mem = kalloc_pages(SUPERORDER)) == 0)
+    return 0;
+  memset(mem, 0, SUPERPGSIZE);
+  if(mappages(p->pagetable, base, SUPERPGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree_pages(mem, SUPERORDER);
+    return 0;
+  }
+  uvmflush(p->pagetable, va);
+  return (uint64)mem + (va - base);
+}
+
+// Handle a fault at user virtual address va below p->sz in
+// the current process, for a write if write is set, or an
+// instruction fetch if it is FAULT_EXEC, where nothing is
+// mapped until first use: exec() leaves the program's pages
+// to be read in by execpage(), and sbrk() only changes p->sz,
+// so that each heap page is allocated, zeroed, when it is
+// first used.
+// A page swapped out is read back in from swap.
+// Returns the physical address now mapped at va, or 0 if va
+// isn't an unmapped page below p->sz, the page couldn't be
+// read, there is no memory, the page is read-only and write
+// is set, or it isn't executable and this is a fetch.
+uint64
+lazyfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+  int perm, r, exec;
+
+  if(p == 0 || pagetable != p->pagetable || va >= p->sz)
+    return 0;
+  exec = write == FAULT_EXEC;
+  if(exec)
+    write = 0;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) != 0 && ((*pte & PTE_V) || *pte == PTE_GUARD))
+    return 0;
+  if(pte && (*pte & PTE_SWAP)){
+    // a page of text comes back on a fetch, but nothing else.
+    if(exec && (*pte & PTE_X) == 0)
+      return 0;
+    if((pa = swapin(pte)) == 0)
+      return 0;
+    uvmflush(pagetable, va);
+    if(write && (*pte & PTE_W) == 0)
+      return 0;
+    return pa;
+  }
+  if(!exec && (pa = lazysuper(p, va)) != 0)
+    return pa;
+  perm = PTE_W;
+  if((r = execpage(p, va, exec, &mem, &perm)) < 0)
+    return 0;
+  if(r == 0 && exec)
+    return 0;  // the heap isn't executable
+  if(r == 0 && (mem = kalloc_zeroed()) == 0)
+    return 0;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_U|perm) != 0){
+    uvmput((uint64)mem);
+    return 0;
+  }
+  // the TLB may hold the page as unmapped.
+  uvmflush(pagetable, va);
+  if(write && (perm & PTE_W) == 0)
+    return 0;
+  return (uint64)mem;
+}
+
+// Handle a write to the copy-on-write page at user virtual
+// address va: give the page a writable copy of its own, or
+// just make it writable if no one else shares it any more.
+// A shared superpage is split first, so that only the page
+// written is copied.
+// Returns the physical address now mapped at va, or 0 if va
+// isn't a copy-on-write page or there is no memory.
+uint64
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, off;
+  char *mem;
+  int level = 0;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return 0;
+  if(level > 0){
+    pa = PTE2PA(*pte);
+    for(off = 0; off < SUPERPGSIZE; off += PGSIZE)
+      if(kowners((void*)(pa + off)) > 1)
+        break;
+    if(off == SUPERPGSIZE){
+      // no one else shares any of it.
+      *pte = (*pte & ~PTE_COW) | PTE_W | PTE_D;
+      uvmflush(pagetable, va);
+      return pteaddr(pte, level, va);
+    }
+    if(demote(pte) != 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  if(kowners((void*)pa) > 1){
+    if((mem = kalloc()) == 0)
+      return 0;
+    memmove(mem, (char*)pa, PGSIZE);
+    kfree((void*)pa);
+    pa = (uint64)mem;
+  }
+  *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W | PTE_D;
+  uvmflush(pagetable, va);
+  return pa;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
+// the page is freed, and the PTE left as PTE_GUARD, which
+// lazyfault() won't map, so that neither the user nor the
+// kernel, through the user window, can use the page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   
+  uvmunmap(pagetable, va, 1, 1);
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  *pte = PTE_GUARD;
+}
+
+extern int ucopybytes(void*, void*, uint64);
+extern int ucopystr(char*, char*, uint64);
+
+// Can the kernel copy len bytes at user address va of
+// pagetable through the user window? Only for the current
+// process, once it has an ASID, and below TRAPFRAME.
+static int
+ucopyok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable && p->asidgen != 0 &&
+         va < TRAPFRAME && len <= TRAPFRAME - va;
+}
+
+// Copy n bytes from src to dst, or a string of at most n bytes
+// if str is set, where one of them is in the user window, with
+// sstatus.SUM set. kerneltrap() maps pages not mapped yet, and
+// makes the copy return -1 at a bad address.
+static int
+ucopy(void *dst, void *src, uint64 n, int str)
+{
+  struct proc *p = myproc();
+  int r;
+
+  push_off();
+  p->ucopy = 1;
+  uvmwindow(p);
+  pop_off();
+
+  w_sstatus(r_sstatus() | SSTATUS_SUM);
+  if(str)
+    r = ucopystr(dst, src, n);
+  else
+    r = ucopybytes(dst, src, n);
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+  p->ucopy = 0;
+  return r;
+}
+
+// Keep swapout() away from the current process's pages (n = 1)
+// while copying through the direct map, or no longer (n = -1).
+// Preempted between finding a page and copying it, the process
+// is RUNNABLE, and the page could be swapped out and freed.
+static void
+upin(int n)
+{
+  struct proc *p = myproc();
+
+  if(p)
+    p->pinned += n;
 }
 
 // Copy from kernel to user.
@@ -360,16 +1015,33 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
   pte_t *pte;
+  int level, r = 0;
 
+  if(ucopyok(pagetable, dstva, len))
+    return ucopy((void*)(UWINDOW + dstva), src, len, 0);
+
+  upin(1);
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    if(va0 >= MAXVA)
-      return -1;
-    pte = walk(pagetable, va0, 0);
+    if(va0 >= MAXVA){
+      r = -1;
+      break;
+    }
+    level = 0;
+    pte = walklevel(pagetable, va0, 0, &level);
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
-      return -1;
-    pa0 = PTE2PA(*pte);
+       (*pte & PTE_W) == 0){
+      // perhaps a page shared since fork, or a heap or
+      // mmap()ed page not mapped yet.
+      if((pa0 = cowfault(pagetable, va0)) == 0 &&
+         (pa0 = lazyfault(pagetable, va0, 1)) == 0 &&
+         (pa0 = mmapfault(pagetable, va0, 1)) == 0){
+        r = -1;
+        break;
+      }
+    } else {
+      pa0 = pteaddr(pte, level, va0);
+    }
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -379,7 +1051,8 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     src += n;
     dstva = va0 + PGSIZE;
   }
-  return 0;
+  upin(-1);
+  return r;
 }
 
 // Copy from user to kernel.
@@ -389,12 +1062,20 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  int r = 0;
+
+  if(ucopyok(pagetable, srcva, len))
+    return ucopy(dst, (void*)(UWINDOW + srcva), len, 0);
 
+  upin(1);
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0 && (pa0 = lazyfault(pagetable, va0, 0)) == 0 &&
+       (pa0 = mmapfault(pagetable, va0, 0)) == 0){
+      r = -1;
+      break;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -404,7 +1085,8 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
     dst += n;
     srcva = va0 + PGSIZE;
   }
-  return 0;
+  upin(-1);
+  return r;
 }
 
 // Copy a null-terminated string from user to kernel.
@@ -417,11 +1099,16 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(ucopyok(pagetable, srcva, max))
+    return ucopy(dst, (void*)(UWINDOW + srcva), max, 1);
+
+  upin(1);
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0 && (pa0 = lazyfault(pagetable, va0, 0)) == 0 &&
+       (pa0 = mmapfault(pagetable, va0, 0)) == 0)
+      break;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
@@ -443,6 +1130,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
     srcva = va0 + PGSIZE;
   }
+  upin(-1);
   if(got_null){
     return 0;
   } else {
@@ -0,0 +1,471 @@
+// Check an xv6 file system image, and describe its layout.
+//
+// Usage: fsck [-v] fs.img
+//
+// The image is mapped read-only. Threads split the inode
+// table between them, each counting the references to every
+// block and to every inode from the files and directories in
+// its share; then they split the blocks, comparing the counts
+// with the bitmap. Finally the directory tree is walked from
+// the root to find inodes that can't be reached.
+//
+// Reports blocks in use but owned by no inode, blocks owned by
+// no one or by two inodes, link counts that don't match the
+// directory entries, and how fragmented files and free space
+// are. -v also lists each inode. Exits with status 1 if the
+// image has errors.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define stat xv6_stat  // avoid clash with host struct stat
+#include "kernel/types.h"
+#include "kernel/fs.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+
+#define MAXTHREAD 16
+
+char *img;
+size_t imgsize;
+struct superblock sb;
+uint datastart;   // first data block
+int verbose;
+
+uchar *owners;    // per block, the number of inodes that claim it
+ushort *refs;     // per inode, directory entries naming it
+uchar *reached;   // per inode, reachable from the root
+
+int nthread;
+int nerror;
+pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+
+// Totals that each thread adds its part to.
+struct stats {
+  uint nfile, ndir, ndev, ninline, norphan;
+  uint nextent, nfragmented, ndata;
+  uint nfree, nfreerun, maxfreerun;
+  uint nleaked;
+};
+
+struct stats total;
+
+void die(const char*);
+
+// convert from riscv byte order; the image's fields are all
+// little-endian, whatever the host. The bitmap is read a byte
+// at a time, so it needs no converting.
+ushort
+xshort(ushort x)
+{
+  uchar *a = (uchar*)&x;
+  return a[0] | a[1] << 8;
+}
+
+uint
+xint(uint x)
+{
+  uchar *a = (uchar*)&x;
+  return a[0] | a[1] << 8 | a[2] << 16 | (uint)a[3] << 24;
+}
+
+char*
+blk(uint b)
+{
+  return img + (size_t)b*BSIZE;
+}
+
+struct dinode*
+dinode(uint inum)
+{
+  return (struct dinode*)blk(IBLOCK(inum, sb)) + inum%IPB;
+}
+
+int
+bitset(uint b)
+{
+  uchar *bits = (uchar*)blk(BBLOCK(b, sb));
+
+  return (bits[(b%BPB)/8] >> (b%8)) & 1;
+}
+
+void
+error(const char *fmt, uint a, uint b, uint c)
+{
+  pthread_mutex_lock(&outlock);
+  printf("fsck: ");
+  printf(fmt, a, b, c);
+  printf("\n");
+  nerror++;
+  pthread_mutex_unlock(&outlock);
+}
+
+// Is ip's content stored inline in ip->addrs[]? Sizes only
+// shrink through itrunc(), so the size alone tells.
+int
+isinline(struct dinode *dip)
+{
+  return xint(dip->size) <= NINLINE;
+}
+
+// Return the block number of block fbn of dip, or 0,
+// whether or not it has been written.
+uint
+bmap(struct dinode *dip, uint fbn)
+{
+  uint ind;
+
+  if(fbn < NDIRECT)
+    return BADDR(xint(dip->addrs[fbn]));
+  ind = xint(dip->addrs[NDIRECT]);
+  if(ind == 0 || ind < datastart || ind >= sb.size)
+    return 0;
+  return BADDR(xint(((uint*)blk(ind))[fbn - NDIRECT]));
+}
+
+// Count a reference to block b from inode inum.
+// Returns 0 if b isn't a data block.
+int
+claim(uint inum, uint b)
+{
+  if(b < datastart || b >= sb.size){
+    error("inode %u: bad block %u", inum, b, 0);
+    return 0;
+  }
+  if(__atomic_fetch_add(&owners[b], 1, __ATOMIC_RELAXED) == 1)
+    error("block %u: used twice, again by inode %u", b, inum, 0);
+  return 1;
+}
+
+// Return the directory entry at off in directory dip,
+// or 0 if it is in a hole.
+struct dirent*
+dirent(struct dinode *dip, uint off)
+{
+  uint b;
+
+  if(isinline(dip))
+    return (struct dirent*)((char*)dip->addrs + off);
+  b = bmap(dip, off/BSIZE);
+  if(b < datastart || b >= sb.size)
+    return 0;
+  return (struct dirent*)(blk(b) + off%BSIZE);
+}
+
+// Count the references from directory inum's entries.
+// "." doesn't count towards a link count; ".." does.
+void
+scandir(uint inum, struct dinode *dip)
+{
+  struct dirent *de;
+  uint off;
+
+  for(off = 0; off + sizeof(*de) <= xint(dip->size); off += sizeof(*de)){
+    if((de = dirent(dip, off)) == 0 || xshort(de->inum) == 0)
+      continue;
+    if(strncmp(de->name, ".", DIRSIZ) == 0)
+      continue;
+    if(xshort(de->inum) >= sb.ninodes){
+      error("directory %u: entry for bad inode %u", inum, xshort(de->inum), 0);
+      continue;
+    }
+    __atomic_fetch_add(&refs[xshort(de->inum)], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Check the inodes in [lo, hi).
+void
+scaninodes(uint lo, uint hi, struct stats *st)
+{
+  struct dinode *dip;
+  uint inum, fbn, b, last, nextent, nblock;
+
+  for(inum = lo; inum < hi; inum++){
+    dip = dinode(inum);
+    if(xshort(dip->type) == 0)
+      continue;
+    if(xshort(dip->type) == T_FILE)
+      st->nfile++;
+    else if(xshort(dip->type) == T_DIR)
+      st->ndir++;
+    else if(xshort(dip->type) == T_DEVICE)
+      st->ndev++;
+    else {
+      error("inode %u: bad type %u", inum, xshort(dip->type), 0);
+      continue;
+    }
+    if(xshort(dip->nlink) == 0)
+      st->norphan++;  // unlinked; the kernel frees it at boot
+    if(xint(dip->size) > MAXFILE*BSIZE){
+      error("inode %u: size %u too big", inum, xint(dip->size), 0);
+      continue;
+    }
+    nextent = nblock = 0;
+    if(isinline(dip)){
+      st->ninline++;
+    } else {
+      // a write that failed can leave blocks past the end,
+      // which are freed with the rest; they count here too.
+      last = 0;
+      for(fbn = 0; fbn < MAXFILE; fbn++){
+        // the indirect block sits in the middle of the run
+        // of a file that mkfs laid out.
+        if(fbn == NDIRECT && xint(dip->addrs[NDIRECT]) == last + 1)
+          last++;
+        if((b = bmap(dip, fbn)) == 0)
+          continue;
+        if(!claim(inum, b))
+          continue;
+        if(b != last + 1)
+          nextent++;
+        last = b;
+        nblock++;
+      }
+      st->ndata += nblock;
+      if(xint(dip->addrs[NDIRECT]))
+        claim(inum, xint(dip->addrs[NDIRECT]));
+      st->nextent += nextent;
+      if(nextent > 1)
+        st->nfragmented++;
+    }
+    if(xshort(dip->type) == T_DIR)
+      scandir(inum, dip);
+    if(verbose){
+      pthread_mutex_lock(&outlock);
+      printf("inode %u: type %d nlink %d size %u, %u blocks in %u extents\n",
+             inum, xshort(dip->type), xshort(dip->nlink), xint(dip->size), nblock, nextent);
+      pthread_mutex_unlock(&outlock);
+    }
+  }
+}
+
+// Compare the bitmap with the block owners in [lo, hi).
+void
+scanblocks(uint lo, uint hi, struct stats *st)
+{
+  uint b, run;
+
+  run = 0;
+  for(b = lo; b < hi; b++){
+    if(bitset(b)){
+      if(run){
+        st->nfreerun++;
+        if(run > st->maxfreerun)
+          st->maxfreerun = run;
+      }
+      run = 0;
+      if(b >= datastart && owners[b] == 0)
+        st->nleaked++;
+    } else {
+      st->nfree++;
+      run++;
+      if(b < datastart)
+        error("block %u: metadata marked free", b, 0, 0);
+      else if(owners[b])
+        error("block %u: in use by a file but marked free", b, 0, 0);
+    }
+  }
+  // a run that goes on into the next range counts once per
+  // range; close enough for statistics.
+  if(run){
+    st->nfreerun++;
+    if(run > st->maxfreerun)
+      st->maxfreerun = run;
+  }
+}
+
+struct work {
+  int phase;
+  uint lo, hi;
+  struct stats st;
+};
+
+void*
+worker(void *arg)
+{
+  struct work *w = arg;
+
+  if(w->phase == 0)
+    scaninodes(w->lo, w->hi, &w->st);
+  else
+    scanblocks(w->lo, w->hi, &w->st);
+  return 0;
+}
+
+// Run phase over [lo, hi) split among the threads, and
+// add up their stats.
+void
+parallel(int phase, uint lo, uint hi)
+{
+  pthread_t tid[MAXTHREAD];
+  struct work w[MAXTHREAD];
+  uint per;
+  int i;
+
+  per = (hi - lo + nthread - 1) / nthread;
+  for(i = 0; i < nthread; i++){
+    memset(&w[i], 0, sizeof(w[i]));
+    w[i].phase = phase;
+    w[i].lo = lo + i*per < hi ? lo + i*per : hi;
+    w[i].hi = w[i].lo + per < hi ? w[i].lo + per : hi;
+    if(pthread_create(&tid[i], 0, worker, &w[i]) != 0)
+      die("pthread_create");
+  }
+  for(i = 0; i < nthread; i++){
+    pthread_join(tid[i], 0);
+    total.nfile += w[i].st.nfile;
+    total.ndir += w[i].st.ndir;
+    total.ndev += w[i].st.ndev;
+    total.ninline += w[i].st.ninline;
+    total.norphan += w[i].st.norphan;
+    total.nextent += w[i].st.nextent;
+    total.nfragmented += w[i].st.nfragmented;
+    total.ndata += w[i].st.ndata;
+    total.nfree += w[i].st.nfree;
+    total.nfreerun += w[i].st.nfreerun;
+    if(w[i].st.maxfreerun > total.maxfreerun)
+      total.maxfreerun = w[i].st.maxfreerun;
+    total.nleaked += w[i].st.nleaked;
+  }
+}
+
+// Mark the inodes reachable from directory inum.
+void
+walk(uint inum)
+{
+  struct dinode *dip;
+  struct dirent *de;
+  uint off;
+
+  if(reached[inum])
+    return;
+  reached[inum] = 1;
+  dip = dinode(inum);
+  if(xshort(dip->type) != T_DIR)
+    return;
+  for(off = 0; off + sizeof(*de) <= xint(dip->size); off += sizeof(*de)){
+    if((de = dirent(dip, off)) == 0 || xshort(de->inum) == 0 || xshort(de->inum) >= sb.ninodes)
+      continue;
+    if(xshort(dinode(xshort(de->inum))->type) == 0){
+      error("directory %u: entry for free inode %u", inum, xshort(de->inum), 0);
+      continue;
+    }
+    walk(xshort(de->inum));
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct dinode *dip;
+  uint inum, nbitmap, i;
+  int fd, n;
+  off_t size;
+
+  if(argc > 1 && strcmp(argv[1], "-v") == 0){
+    verbose = 1;
+    argc--;
+    argv++;
+  }
+  if(argc != 2){
+    fprintf(stderr, "Usage: fsck [-v] fs.img\n");
+    exit(1);
+  }
+
+  if((fd = open(argv[1], O_RDONLY)) < 0)
+    die(argv[1]);
+  if((size = lseek(fd, 0, SEEK_END)) < 2*BSIZE){
+    fprintf(stderr, "fsck: %s: too small\n", argv[1]);
+    exit(1);
+  }
+  imgsize = size;
+  img = mmap(0, imgsize, PROT_READ, MAP_SHARED, fd, 0);
+  if(img == MAP_FAILED)
+    die("mmap");
+
+  memmove(&sb, blk(1), sizeof(sb));
+  for(i = 0; i < sizeof(sb)/sizeof(uint); i++)
+    ((uint*)&sb)[i] = xint(((uint*)&sb)[i]);
+  if(sb.magic != FSMAGIC){
+    fprintf(stderr, "fsck: %s: not a file system\n", argv[1]);
+    exit(1);
+  }
+  nbitmap = sb.size/BPB + 1;
+  datastart = sb.bmapstart + nbitmap;
+  if((size_t)sb.size*BSIZE > imgsize || datastart >= sb.size ||
+     IBLOCK(sb.ninodes - 1, sb) >= sb.bmapstart ||
+     (sb.nswap && (sb.swapstart < sb.size ||
+                   (size_t)(sb.swapstart + sb.nswap)*BSIZE > imgsize))){
+    fprintf(stderr, "fsck: %s: bad superblock\n", argv[1]);
+    exit(1);
+  }
+  printf("size %u blocks: log %u at %u, %u inodes at %u, bitmap at %u, data at %u, swap %u at %u\n",
+         sb.size, sb.nlog, sb.logstart, sb.ninodes, sb.inodestart, sb.bmapstart, datastart,
+         sb.nswap, sb.swapstart);
+
+  n = xint(*(uint*)blk(sb.logstart));
+  if(n != 0)
+    printf("log: %d blocks committed but not installed; the kernel will install them\n", n);
+
+  nthread = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthread < 1)
+    nthread = 1;
+  if(nthread > MAXTHREAD)
+    nthread = MAXTHREAD;
+
+  owners = calloc(sb.size, 1);
+  refs = calloc(sb.ninodes, sizeof(ushort));
+  reached = calloc(sb.ninodes, 1);
+  if(owners == 0 || refs == 0 || reached == 0)
+    die("calloc");
+
+  parallel(0, 1, sb.ninodes);
+  parallel(1, 0, sb.size);
+
+  if(xshort(dinode(ROOTINO)->type) != T_DIR)
+    error("root inode %u isn't a directory", ROOTINO, 0, 0);
+  else
+    walk(ROOTINO);
+
+  for(inum = 1; inum < sb.ninodes; inum++){
+    dip = dinode(inum);
+    if(xshort(dip->type) == 0){
+      if(refs[inum])
+        error("inode %u: free but named %u times", inum, refs[inum], 0);
+      continue;
+    }
+    if(xshort(dip->nlink) == 0)
+      continue;
+    // a directory is also named by its subdirectories' "..".
+    if(refs[inum] != xshort(dip->nlink))
+      error("inode %u: nlink %u but named %u times", inum, xshort(dip->nlink), refs[inum]);
+    if(!reached[inum])
+      error("inode %u: not reachable from the root", inum, 0, 0);
+  }
+  if(total.nleaked)
+    error("%u blocks marked in use but owned by no inode", total.nleaked, 0, 0);
+
+  printf("%u files, %u directories, %u devices, %u inline, %u unlinked\n",
+         total.nfile, total.ndir, total.ndev, total.ninline, total.norphan);
+  printf("%u data blocks in %u extents, %u files fragmented\n",
+         total.ndata, total.nextent, total.nfragmented);
+  printf("%u free blocks in %u runs, longest %u\n",
+         total.nfree, total.nfreerun, total.maxfreerun);
+  printf("%d errors\n", nerror);
+
+  munmap(img, imgsize);
+  close(fd);
+  exit(nerror ? 1 : 0);
+}
+
+void
+die(const char *s)
+{
+  perror(s);
+  exit(1);
+}
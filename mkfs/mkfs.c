@@ -4,6 +4,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "kernel/types.h"
@@ -18,7 +19,21 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks | swap ]
+//
+// The swap area, NSWAP blocks after the FSSIZE blocks of the
+// file system, is left as zeros; only the kernel uses it.
+//
+// The image is built in place in fs.img mapped into memory,
+// so the inode table, the bitmap and file contents are filled
+// in with plain stores and reach the file in bulk. Each file
+// is laid out in one run of blocks: its direct blocks, its
+// indirect block, then the rest of its data.
+//
+// With -u, an existing image is updated instead: only files
+// whose content differs from the image's copy are rewritten,
+// and new ones are added to the root directory. Other files,
+// including any created while running xv6, are left alone.
 
 int nbitmap = FSSIZE/BPB + 1;
 int ninodeblocks = NINODES / IPB + 1;
@@ -27,19 +42,29 @@ int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+char *img;    // fs.img, mapped
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
-uint freeblock;
+uint freeblock;   // where to start looking for free blocks
 
+struct dirent *root;  // the root directory's entries
+uint nroot;           // number of them, used or not
+int rootdirty;
 
-void balloc(int);
-void wsect(uint, void*);
-void winode(uint, struct dinode*);
-void rinode(uint inum, struct dinode *ip);
-void rsect(uint sec, void *buf);
+
+void mapimage(void);
+char *blk(uint);
+struct dinode *dinode(uint);
+int used(uint);
+void setused(uint, int);
 uint ialloc(ushort type);
-void iappend(uint inum, void *p, int n);
+uint balloc(uint);
+void ifree(uint);
+void iwrite(uint, char*, uint);
+char *iread(uint, uint*);
+void mkimage(char*);
+int openimage(char*);
+int addfile(char*, char*);
 void die(const char *);
 
 // convert to riscv byte order
@@ -68,65 +93,37 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
-  char buf[BSIZE];
-  struct dinode din;
-
+  int i, update, nwritten;
+  uint size;
+  char *buf;
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  update = argc > 1 && strcmp(argv[1], "-u") == 0;
+  if(update){
+    argc--;
+    argv++;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-u] fs.img files...\n");
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
-  if(fsfd < 0)
-    die(argv[1]);
-
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
-  sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
-  sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
-  sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
-
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
-
-  freeblock = nmeta;     // the first free block that we can allocate
-
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
-  memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
-
-  rootino = ialloc(T_DIR);
-  assert(rootino == ROOTINO);
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  if(update && openimage(argv[1]) < 0){
+    printf("mkfs: can't update %s, rebuilding it\n", argv[1]);
+    update = 0;
+  }
+  if(!update)
+    mkimage(argv[1]);
 
+  nwritten = 0;
   for(i = 2; i < argc; i++){
     // get rid of "user/"
     char *shortname;
@@ -134,11 +131,8 @@ main(int argc, char *argv[])
       shortname = argv[i] + 5;
     else
       shortname = argv[i];
-    
-    assert(index(shortname, '/') == 0);
 
-    if((fd = open(argv[i], 0)) < 0)
-      die(argv[i]);
+    assert(index(shortname, '/') == 0);
 
     // Skip leading _ in name when writing to file system.
     // The binaries are named _rm, _cat, etc. to keep the
@@ -148,151 +142,360 @@ main(int argc, char *argv[])
       shortname += 1;
 
     assert(strlen(shortname) <= DIRSIZ);
-    
-    inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
-
-    close(fd);
+    nwritten += addfile(argv[i], shortname);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(rootdirty){
+    // a directory that doesn't fit in its inode gets
+    // whole blocks, with room for more entries.
+    size = nroot * sizeof(struct dirent);
+    if(size > NINLINE)
+      size = ((size + BSIZE - 1) / BSIZE) * BSIZE;
+    if((buf = calloc(1, size)) == 0)
+      die("calloc");
+    memmove(buf, root, nroot * sizeof(struct dirent));
+    iwrite(ROOTINO, buf, size);
+    free(buf);
+  }
 
-  balloc(freeblock);
+  printf("mkfs: %d of %d files written\n", nwritten, argc - 2);
 
+  if(msync(img, (size_t)FSSIZE*BSIZE, MS_SYNC) < 0)
+    die("msync");
+  munmap(img, (size_t)FSSIZE*BSIZE);
+  close(fsfd);
   exit(0);
 }
 
+// Map the file system part of the image file, which must be
+// FSSIZE+NSWAP blocks long.
 void
-wsect(uint sec, void *buf)
+mapimage(void)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  img = mmap(0, (size_t)FSSIZE*BSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED)
+    die("mmap");
 }
 
+// Create an empty file system in path, holding
+// just the root directory.
 void
-winode(uint inum, struct dinode *ip)
+mkimage(char *path)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
+  uint b, rootino;
+
+  fsfd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fsfd < 0)
+    die(path);
+  // a new file reads as zeros, so nothing needs clearing.
+  if(ftruncate(fsfd, (off_t)(FSSIZE+NSWAP)*BSIZE) < 0)
+    die("ftruncate");
+  mapimage();
+
+  sb.magic = FSMAGIC;
+  sb.size = xint(FSSIZE);
+  sb.nblocks = xint(nblocks);
+  sb.ninodes = xint(NINODES);
+  sb.nlog = xint(nlog);
+  sb.logstart = xint(2);
+  sb.inodestart = xint(2+nlog);
+  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(FSSIZE);
+  sb.nswap = xint(NSWAP);
+  memmove(blk(1), &sb, sizeof(sb));
+
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d swap %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE, NSWAP);
 
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  for(b = 0; b < nmeta; b++)
+    setused(b, 1);
+  freeblock = nmeta;     // the first free block that we can allocate
+
+  rootino = ialloc(T_DIR);
+  assert(rootino == ROOTINO);
+
+  if((root = calloc(2, sizeof(struct dirent))) == 0)
+    die("calloc");
+  root[0].inum = xshort(rootino);
+  strcpy(root[0].name, ".");
+  root[1].inum = xshort(rootino);
+  strcpy(root[1].name, "..");
+  nroot = 2;
+  rootdirty = 1;
 }
 
-void
-rinode(uint inum, struct dinode *ip)
+// Open the file system in path for updating.
+// Returns -1 if it isn't a file system that this mkfs would
+// build, or if its log holds a transaction that xv6 hasn't
+// installed yet.
+int
+openimage(char *path)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
+  uint size;
+
+  if((fsfd = open(path, O_RDWR)) < 0)
+    return -1;
+  if(lseek(fsfd, 0, SEEK_END) != (off_t)(FSSIZE+NSWAP)*BSIZE){
+    close(fsfd);
+    return -1;
+  }
+  mapimage();
+
+  memmove(&sb, blk(1), sizeof(sb));
+  if(sb.magic != FSMAGIC || xint(sb.size) != FSSIZE || xint(sb.nblocks) != nblocks ||
+     xint(sb.ninodes) != NINODES || xint(sb.nlog) != nlog || xint(sb.logstart) != 2 ||
+     xint(sb.inodestart) != 2+nlog || xint(sb.bmapstart) != 2+nlog+ninodeblocks ||
+     xint(sb.swapstart) != FSSIZE || xint(sb.nswap) != NSWAP ||
+     xint(*(uint*)blk(xint(sb.logstart))) != 0 ||
+     xshort(dinode(ROOTINO)->type) != T_DIR){
+    munmap(img, (size_t)FSSIZE*BSIZE);
+    close(fsfd);
+    return -1;
+  }
+  freeblock = nmeta;
+
+  root = (struct dirent*)iread(ROOTINO, &size);
+  nroot = size / sizeof(struct dirent);
+  return 0;
+}
+
+// Return a pointer to block b of the image.
+char*
+blk(uint b)
+{
+  assert(b < FSSIZE);
+  return img + (size_t)b*BSIZE;
+}
+
+struct dinode*
+dinode(uint inum)
+{
+  assert(inum < NINODES);
+  return (struct dinode*)blk(IBLOCK(inum, sb)) + inum%IPB;
+}
+
+int
+used(uint b)
+{
+  uchar *bits = (uchar*)blk(BBLOCK(b, sb));
 
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  return (bits[(b%BPB)/8] >> (b%8)) & 1;
 }
 
 void
-rsect(uint sec, void *buf)
+setused(uint b, int u)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  uchar *bits = (uchar*)blk(BBLOCK(b, sb));
+
+  if(u)
+    bits[(b%BPB)/8] |= 1 << (b%8);
+  else
+    bits[(b%BPB)/8] &= ~(1 << (b%8));
 }
 
 uint
 ialloc(ushort type)
 {
-  uint inum = freeinode++;
-  struct dinode din;
-
-  bzero(&din, sizeof(din));
-  din.type = xshort(type);
-  din.nlink = xshort(1);
-  din.size = xint(0);
-  winode(inum, &din);
-  return inum;
+  struct dinode *dip;
+  uint inum;
+
+  for(inum = freeinode; inum < NINODES; inum++){
+    dip = dinode(inum);
+    if(xshort(dip->type) == 0){
+      memset(dip, 0, sizeof(*dip));
+      dip->type = xshort(type);
+      dip->nlink = xshort(1);
+      dip->size = xint(0);
+      freeinode = inum + 1;
+      return inum;
+    }
+  }
+  fprintf(stderr, "mkfs: out of inodes\n");
+  exit(1);
+}
+
+// Allocate a run of n free blocks and return the first.
+uint
+balloc(uint n)
+{
+  uint b, start, len, pass;
+
+  for(pass = 0; pass < 2; pass++){
+    len = 0;
+    start = pass == 0 ? freeblock : nmeta;
+    for(b = start; b < FSSIZE; b++){
+      if(used(b)){
+        len = 0;
+        continue;
+      }
+      if(++len == n){
+        start = b + 1 - n;
+        for(b = start; b < start + n; b++)
+          setused(b, 1);
+        freeblock = start + n;
+        return start;
+      }
+    }
+  }
+  fprintf(stderr, "mkfs: no run of %u free blocks\n", n);
+  exit(1);
 }
 
+// Free the blocks of inode inum.
 void
-balloc(int used)
+ifree(uint inum)
 {
-  uchar buf[BSIZE];
+  struct dinode *dip = dinode(inum);
+  uint *a;
   int i;
 
-  printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  if(xint(dip->size) > NINLINE){
+    for(i = 0; i < NDIRECT; i++)
+      if(dip->addrs[i])
+        setused(BADDR(xint(dip->addrs[i])), 0);
+    if(dip->addrs[NDIRECT]){
+      a = (uint*)blk(xint(dip->addrs[NDIRECT]));
+      for(i = 0; i < NINDIRECT; i++)
+        if(a[i])
+          setused(BADDR(xint(a[i])), 0);
+      setused(xint(dip->addrs[NDIRECT]), 0);
+    }
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  memset(dip->addrs, 0, sizeof(dip->addrs));
+  dip->size = xint(0);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Replace the content of inode inum with the n bytes at p.
 void
-iappend(uint inum, void *xp, int n)
+iwrite(uint inum, char *p, uint n)
 {
-  char *p = (char*)xp;
-  uint fbn, off, n1;
-  struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
-  uint x;
-
-  rinode(inum, &din);
-  off = xint(din.size);
-  // printf("append inum %d at off %d sz %d\n", inum, off, n);
-  while(n > 0){
-    fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
+  struct dinode *dip = dinode(inum);
+  uint nb, start, fbn, b, *a;
+
+  ifree(inum);
+  if(n <= NINLINE){
+    // small enough to live in the inode.
+    memmove(dip->addrs, p, n);
+    dip->size = xint(n);
+    return;
+  }
+
+  nb = (n + BSIZE - 1) / BSIZE;
+  assert(nb <= MAXFILE);
+  start = balloc(nb + (nb > NDIRECT));
+  a = 0;
+  for(fbn = 0; fbn < nb; fbn++){
+    b = start + fbn + (fbn >= NDIRECT);
     if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
+      dip->addrs[fbn] = xint(b);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      if(a == 0){
+        dip->addrs[NDIRECT] = xint(start + NDIRECT);
+        a = (uint*)blk(start + NDIRECT);
+        memset(a, 0, BSIZE);
       }
-      x = xint(indirect[fbn-NDIRECT]);
+      a[fbn - NDIRECT] = xint(b);
+    }
+    memset(blk(b), 0, BSIZE);
+    memmove(blk(b), p + fbn*BSIZE, min(n - fbn*BSIZE, BSIZE));
+  }
+  dip->size = xint(n);
+}
+
+// Return a copy of the content of inode inum, and its size
+// in *np.
+char*
+iread(uint inum, uint *np)
+{
+  struct dinode *dip = dinode(inum);
+  uint n, fbn, b, *a;
+  char *p;
+
+  n = xint(dip->size);
+  if((p = calloc(1, n + 1)) == 0)
+    die("calloc");
+  *np = n;
+  if(n <= NINLINE){
+    memmove(p, dip->addrs, n);
+    return p;
+  }
+  for(fbn = 0; fbn*BSIZE < n; fbn++){
+    if(fbn < NDIRECT){
+      b = xint(dip->addrs[fbn]);
+    } else {
+      if(dip->addrs[NDIRECT] == 0)
+        break;
+      a = (uint*)blk(xint(dip->addrs[NDIRECT]));
+      b = xint(a[fbn - NDIRECT]);
+    }
+    if(b && (b & BUNWRITTEN) == 0)  // else a hole, or unwritten
+      memmove(p + fbn*BSIZE, blk(b), min(n - fbn*BSIZE, BSIZE));
+  }
+  return p;
+}
+
+// Put the host file path in the root directory as name,
+// unless the image has it already.
+// Returns 1 if the image changed, 0 if not.
+int
+addfile(char *path, char *name)
+{
+  char *data, *old;
+  struct dirent *de, *empty;
+  uint inum, n, oldn;
+  off_t size;
+  int fd;
+
+  if((fd = open(path, 0)) < 0)
+    die(path);
+  if((size = lseek(fd, 0, SEEK_END)) < 0 || lseek(fd, 0, SEEK_SET) < 0)
+    die(path);
+  n = size;
+  if((data = malloc(n + 1)) == 0)
+    die("malloc");
+  if(read(fd, data, n) != n)
+    die(path);
+  close(fd);
+
+  empty = 0;
+  for(de = root; de < root + nroot; de++){
+    if(de->inum == 0){
+      if(empty == 0)
+        empty = de;
+      continue;
     }
-    n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
-    n -= n1;
-    off += n1;
-    p += n1;
+    if(strncmp(de->name, name, DIRSIZ) == 0)
+      break;
   }
-  din.size = xint(off);
-  winode(inum, &din);
+
+  if(de < root + nroot){
+    inum = xshort(de->inum);
+    old = iread(inum, &oldn);
+    if(oldn == n && memcmp(old, data, n) == 0){
+      free(old);
+      free(data);
+      return 0;
+    }
+    free(old);
+  } else {
+    inum = ialloc(T_FILE);
+    if(empty == 0){
+      if((root = realloc(root, (nroot + 1) * sizeof(*root))) == 0)
+        die("realloc");
+      empty = &root[nroot++];
+    }
+    memset(empty, 0, sizeof(*empty));
+    empty->inum = xshort(inum);
+    strncpy(empty->name, name, DIRSIZ);
+    rootdirty = 1;
+  }
+
+  iwrite(inum, data, n);
+  free(data);
+  return 1;
 }
 
 void
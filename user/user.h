@@ -1,4 +1,6 @@
 struct stat;
+struct iovec;
+struct dirstat;
 
 // system calls
 int fork(void);
@@ -22,6 +24,15 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int sendfile(int, int, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int getdents(int, struct dirstat*, int, int);
+int fallocate(int, uint, uint);
 
 // ulib.c
 int stat(const char*, struct stat*);
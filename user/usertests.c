@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/elf.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2586,6 +2587,1440 @@ badarg(char *s)
   exit(0);
 }
 
+// small files and directories keep their data in the inode;
+// make sure they read back correctly before and after they
+// grow out of it, and after truncation.
+void
+inlinefile(char *s)
+{
+  char data[200], back[200];
+  struct stat st;
+  int fd, i;
+
+  for(i = 0; i < sizeof(data); i++)
+    data[i] = 'a' + i % 26;
+
+  unlink("inl");
+  fd = open("inl", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create inl failed\n", s);
+    exit(1);
+  }
+  if(write(fd, data, 10) != 10 || write(fd, data+10, 40) != 40){
+    printf("%s: small write failed\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != 50){
+    printf("%s: size %d, not 50\n", s, (int)st.size);
+    exit(1);
+  }
+  // grow past the inline area.
+  if(write(fd, data+50, 150) != 150){
+    printf("%s: growing write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("inl", O_RDONLY);
+  if(read(fd, back, sizeof(back)) != sizeof(back) || memcmp(data, back, sizeof(data)) != 0){
+    printf("%s: wrong data after growing\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("inl", O_RDWR|O_TRUNC);
+  if(write(fd, "xyz", 3) != 3){
+    printf("%s: write after truncate failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inl", O_RDONLY);
+  if(read(fd, back, sizeof(back)) != 3 || memcmp(back, "xyz", 3) != 0){
+    printf("%s: wrong data after truncate\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("inl");
+
+  // a directory starts inline, then grows.
+  if(mkdir("inldir") < 0){
+    printf("%s: mkdir inldir failed\n", s);
+    exit(1);
+  }
+  char name[16];
+  strcpy(name, "inldir/f0");
+  for(i = 0; i < 6; i++){
+    name[8] = '0' + i;
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < 6; i++){
+    name[8] = '0' + i;
+    if(unlink(name) < 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("inldir") < 0){
+    printf("%s: unlink inldir failed\n", s);
+    exit(1);
+  }
+}
+
+// write a file through the delayed-allocation path: read it
+// back before and after close, and check that an unlinked
+// file's delayed blocks are thrown away.
+void
+delayalloc(char *s)
+{
+  enum { NB = 20 };
+  static char buf[BSIZE];
+  int fd, i;
+
+  unlink("dalloc");
+  fd = open("dalloc", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create dalloc failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NB; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write dalloc failed\n", s);
+      exit(1);
+    }
+  }
+  // read back through the same fd, before any close.
+  for(i = 0; i < NB; i++){
+    if(pread(fd, buf, sizeof(buf), i*BSIZE) != sizeof(buf)){
+      printf("%s: read dalloc failed\n", s);
+      exit(1);
+    }
+    if(buf[0] != 'a' + i || buf[BSIZE-1] != 'a' + i){
+      printf("%s: wrong data in block %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("dalloc", O_RDONLY);
+  for(i = 0; i < NB; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[7] != 'a' + i){
+      printf("%s: wrong data after close in block %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("dalloc");
+
+  // a temp file: written, unlinked while open, then closed.
+  fd = open("dalloc", O_CREATE|O_RDWR);
+  unlink("dalloc");
+  for(i = 0; i < 4; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write unlinked file failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// reads and overwrites that straddle page and block
+// boundaries, through the page cache.
+void
+pagecache(char *s)
+{
+  enum { SZ = 3*4096 + 100 };
+  static char buf[SZ], back[SZ];
+  int fd, i, n, off;
+
+  for(i = 0; i < SZ; i++)
+    buf[i] = i % 251;
+  unlink("pcache");
+  fd = open("pcache", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: write pcache failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // overwrite a range that crosses a page boundary.
+  fd = open("pcache", O_RDWR);
+  for(off = 0; off < 4096 - 10; ){
+    n = read(fd, back, 1000);
+    if(n != 1000){
+      printf("%s: read pcache failed\n", s);
+      exit(1);
+    }
+    off += n;
+  }
+  memset(buf + off, 'x', 3000);
+  if(write(fd, buf + off, 3000) != 3000){
+    printf("%s: overwrite pcache failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("pcache", O_RDONLY);
+  for(off = 0; off < SZ; off += n){
+    n = read(fd, back + off, 777);
+    if(n <= 0){
+      printf("%s: short read at %d\n", s, off);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(memcmp(buf, back, SZ) != 0){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  unlink("pcache");
+}
+
+// file-backed and anonymous mmap(), shared and private,
+// across fork(), partial munmap(), and as a system call buffer.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*4096 + 2000 };
+  static char buf[SZ];
+  char *p, *q;
+  int fd, i, pid, xstatus;
+
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  unlink("mmapf");
+  fd = open("mmapf", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: create mmapf failed\n", s);
+    exit(1);
+  }
+
+  // shared: writes through the mapping reach the file.
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(memcmp(p, buf, SZ) != 0){
+    printf("%s: wrong data in shared mapping\n", s);
+    exit(1);
+  }
+  p[10] = 'X';
+  p[4096+10] = 'Y';
+  buf[10] = 'X';
+  buf[4096+10] = 'Y';
+  if(munmap(p, SZ) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // private: writes stay in the process.
+  fd = open("mmapf", O_RDONLY);
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  if(memcmp(p, buf, SZ) != 0){
+    printf("%s: shared writes were lost\n", s);
+    exit(1);
+  }
+  p[20] = 'Z';
+  // read() into a mapped buffer faults it in from the kernel.
+  q = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(q == (char*)-1){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  if(read(fd, q, SZ) != SZ || memcmp(q, buf, SZ) != 0){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  if(mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable shared mapping of a read-only file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // the child gets copies of private pages.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[20] != 'Z' || q[4096] != buf[4096])
+      exit(1);
+    p[20] = 'C';
+    q[0] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[20] != 'Z' || q[0] != buf[0]){
+    printf("%s: mappings not copied by fork\n", s);
+    exit(1);
+  }
+
+  // unmap the middle page; the rest stays.
+  if(munmap(q + 4096, 4096) != 0 || q[0] != buf[0] || q[2*4096] != buf[2*4096]){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  munmap(q, SZ);
+  munmap(p, SZ);
+  unlink("mmapf");
+}
+
+// sendfile() from a file to a pipe, from a pipe to a file,
+// and from a file to a file.
+void
+sendfiletest(char *s)
+{
+  enum { SZ = 3*4096 + 300 };
+  static char buf[SZ], back[SZ];
+  int fd, fd1, fds[2], i, n, tot, pid, xstatus;
+
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 13;
+  unlink("sendf1");
+  unlink("sendf2");
+  fd = open("sendf1", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: create sendf1 failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("sendf1", O_RDONLY);
+    for(tot = 0; (n = sendfile(fds[1], fd, 1000)) > 0; tot += n)
+      ;
+    exit(n == 0 && tot == SZ ? 0 : 1);
+  }
+  close(fds[1]);
+  fd1 = open("sendf2", O_CREATE|O_RDWR);
+  for(tot = 0; (n = sendfile(fd1, fds[0], SZ)) > 0; tot += n)
+    ;
+  close(fds[0]);
+  close(fd1);
+  wait(&xstatus);
+  if(xstatus != 0 || n != 0 || tot != SZ){
+    printf("%s: sendfile through a pipe failed\n", s);
+    exit(1);
+  }
+
+  // file to file, from the middle.
+  fd = open("sendf2", O_RDONLY);
+  fd1 = open("sendf1", O_RDWR|O_TRUNC);
+  if(read(fd, back, 100) != 100 || sendfile(fd1, fd, SZ) != SZ - 100){
+    printf("%s: sendfile between files failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  close(fd1);
+  fd = open("sendf1", O_RDONLY);
+  if(read(fd, back, SZ) != SZ - 100 || memcmp(back, buf + 100, SZ - 100) != 0){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("sendf1");
+  unlink("sendf2");
+}
+
+// readv(), writev(), pread() and pwrite().
+void
+iovtest(char *s)
+{
+  struct iovec iov[3];
+  char a[10], b[20], c[30], buf[60];
+  int fd;
+
+  memset(a, 'a', sizeof(a));
+  memset(b, 'b', sizeof(b));
+  memset(c, 'c', sizeof(c));
+  iov[0].iov_base = a; iov[0].iov_len = sizeof(a);
+  iov[1].iov_base = b; iov[1].iov_len = sizeof(b);
+  iov[2].iov_base = c; iov[2].iov_len = sizeof(c);
+
+  unlink("iovf");
+  fd = open("iovf", O_CREATE|O_RDWR);
+  if(fd < 0 || writev(fd, iov, 3) != 60){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  // positional I/O doesn't move the offset.
+  if(pwrite(fd, "XY", 2, 9) != 2 || write(fd, "z", 1) != 1){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 4, 8) != 4 || memcmp(buf, "aXYb", 4) != 0){
+    printf("%s: pread got wrong data\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, sizeof(buf), 1000) > 0){
+    printf("%s: pread past the end\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("iovf", O_RDONLY);
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  memset(c, 0, sizeof(c));
+  if(readv(fd, iov, 3) != 60 || a[8] != 'a' || a[9] != 'X' || b[0] != 'Y' ||
+     b[19] != 'b' || c[29] != 'c'){
+    printf("%s: readv got wrong data\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, sizeof(buf)) != 1 || buf[0] != 'z'){
+    printf("%s: readv left the offset wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("iovf");
+}
+
+// readers of one file run at the same time, alongside a writer
+// that keeps rewriting it with the same content; readers
+// sharing one open file must still see each byte once.
+void
+sharedread(char *s)
+{
+  char buf[512];
+  int fd, i, j, k, n, pid, xstatus, tot;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  unlink("shrf");
+  fd = open("shrf", O_CREATE|O_RDWR);
+  for(i = 0; i < 16; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(k = 0; k < 4; k++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 20; j++){
+        fd = open("shrf", k == 0 ? O_RDWR : O_RDONLY);
+        if(fd < 0){
+          printf("%s: open failed\n", s);
+          exit(1);
+        }
+        for(i = 0; i < 16; i++){
+          if(k == 0){
+            if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+              exit(1);
+            continue;
+          }
+          memset(buf, 0, sizeof(buf));
+          if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+            printf("%s: short read\n", s);
+            exit(1);
+          }
+          for(n = 0; n < sizeof(buf); n++){
+            if(buf[n] != 'a' + n % 26){
+              printf("%s: wrong data\n", s);
+              exit(1);
+            }
+          }
+        }
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for(k = 0; k < 4; k++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  fd = open("shrf", O_RDONLY);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  tot = 0;
+  while((n = read(fd, buf, 7)) > 0)
+    tot += n;
+  if(pid == 0)
+    exit(tot);
+  wait(&xstatus);
+  if(tot + xstatus != 16*sizeof(buf)){
+    printf("%s: shared offset read %d bytes\n", s, tot + xstatus);
+    exit(1);
+  }
+  close(fd);
+  unlink("shrf");
+}
+
+// getdents() lists a directory in a few calls, with the stat
+// of each entry.
+void
+getdentstest(char *s)
+{
+  struct dirstat ds[4];
+  struct stat st;
+  char name[8];
+  int fd, i, n, tot, seen;
+
+  if(mkdir("gdd") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  name[0] = 'g'; name[1] = 'd'; name[2] = 'd'; name[3] = '/';
+  name[4] = 'f'; name[6] = 0;
+  for(i = 0; i < 10; i++){
+    name[5] = '0' + i;
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, name, i) != i){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  name[5] = '3';
+  unlink(name);
+
+  fd = open("gdd", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  tot = seen = 0;
+  while((n = getdents(fd, ds, 4, GD_STAT)) > 0){
+    for(i = 0; i < n; i++){
+      tot++;
+      if(ds[i].name[0] != 'f')
+        continue;
+      seen |= 1 << (ds[i].name[1] - '0');
+      if(ds[i].st.type != T_FILE || ds[i].st.size != ds[i].name[1] - '0'){
+        printf("%s: wrong stat for %s\n", s, ds[i].name);
+        exit(1);
+      }
+      if(stat("gdd/f0", &st) < 0 || (ds[i].name[1] == '0' && st.ino != ds[i].st.ino)){
+        printf("%s: wrong ino\n", s);
+        exit(1);
+      }
+    }
+  }
+  if(n < 0 || tot != 11 || seen != (0x3ff & ~(1 << 3))){
+    printf("%s: listed %d entries\n", s, tot);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("gdd/f0", O_RDONLY);
+  if(getdents(fd, ds, 4, 0) >= 0){
+    printf("%s: getdents of a file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < 10; i++){
+    name[5] = '0' + i;
+    unlink(name);
+  }
+  if(unlink("gdd") < 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+}
+
+// writing past the end of a file leaves a hole that reads as
+// zeros; fallocate() gives a range blocks without changing
+// what it reads as.
+void
+sparsefile(char *s)
+{
+  char buf[BSIZE];
+  struct stat st;
+  int fd, i;
+
+  unlink("sparsef");
+  fd = open("sparsef", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "end", 3, 20*BSIZE) != 3){
+    printf("%s: pwrite past the end failed\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != 20*BSIZE + 3){
+    printf("%s: wrong size after a hole\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, 'x', sizeof(buf));
+    if(pread(fd, buf, sizeof(buf), i*BSIZE) != sizeof(buf)){
+      printf("%s: read of hole failed\n", s);
+      exit(1);
+    }
+    for(int j = 0; j < sizeof(buf); j++){
+      if(buf[j] != 0){
+        printf("%s: hole isn't zero\n", s);
+        exit(1);
+      }
+    }
+  }
+
+  if(fallocate(fd, 5*BSIZE, 40*BSIZE) < 0){
+    printf("%s: fallocate failed\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != 45*BSIZE){
+    printf("%s: fallocate didn't grow the file\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, 3, 20*BSIZE) != 3 || memcmp(buf, "end", 3) != 0){
+    printf("%s: fallocate changed the data\n", s);
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  if(pread(fd, buf, sizeof(buf), 30*BSIZE) != sizeof(buf) || buf[0] != 0 || buf[BSIZE-1] != 0){
+    printf("%s: allocated block isn't zero\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "mid", 3, 30*BSIZE + 7) != 3 ||
+     pread(fd, buf, 3, 30*BSIZE + 7) != 3 || memcmp(buf, "mid", 3) != 0){
+    printf("%s: write to allocated block failed\n", s);
+    exit(1);
+  }
+  // the rest of the block was never written, and stays zero.
+  memset(buf, 'x', sizeof(buf));
+  if(pread(fd, buf, sizeof(buf), 30*BSIZE) != sizeof(buf) ||
+     buf[6] != 0 || buf[10] != 0 || buf[BSIZE-1] != 0){
+    printf("%s: write to allocated block didn't zero the rest\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(".", O_RDONLY);
+  if(fallocate(fd, 0, BSIZE) >= 0){
+    printf("%s: fallocate of a directory\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("sparsef");
+}
+
+// inodes changed by concurrent appends, which share log
+// commits, reach the disk with the right sizes, and are
+// seen right by a reopen before the commit.
+void
+appendsize(char *s)
+{
+  char name[8];
+  struct stat st;
+  int fd, i, j, pid, xstatus;
+
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[0] = 'a'; name[1] = 'p'; name[2] = '0' + i; name[3] = 0;
+      unlink(name);
+      for(j = 0; j < 50; j++){
+        fd = open(name, O_CREATE|O_WRONLY);
+        if(fd < 0 || pwrite(fd, "0123456789", 10, j*10) != 10){
+          printf("%s: append failed\n", s);
+          exit(1);
+        }
+        close(fd);
+        if(stat(name, &st) < 0 || st.size != (j+1)*10){
+          printf("%s: size %d after %d appends\n", s, (int)st.size, j+1);
+          exit(1);
+        }
+      }
+      unlink(name);
+      exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+// freed pages must come back zeroed, whether from the pool
+// of zeroed pages or zeroed on demand.
+void
+zeroedpages(char *s)
+{
+  int round, i, n = 64;
+  char *p;
+
+  for(round = 0; round < 4; round++){
+    p = sbrk(n * PGSIZE);
+    if(p == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n * PGSIZE; i++){
+      if(p[i] != 0){
+        printf("%s: round %d byte %d is %d\n", s, round, i, p[i]);
+        exit(1);
+      }
+    }
+    memset(p, 0xab, n * PGSIZE);
+    if(sbrk(-n * PGSIZE) == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk shrink failed\n", s);
+      exit(1);
+    }
+    // let the zeroing thread run.
+    if(round & 1)
+      sleep(1);
+  }
+}
+
+// several processes grow and shrink their memory by uneven
+// amounts at once, so that pages are split off and merged
+// back into larger blocks; each checks its memory is intact.
+void
+buddychurn(char *s)
+{
+  int i, j, k, pid, xst, n;
+  char *base, *p;
+
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      base = sbrk(0);
+      for(j = 0; j < 20; j++){
+        n = ((i * 7 + j * 13) % 29 + 1) * PGSIZE;
+        p = sbrk(n);
+        if(p == (char*)0xffffffffffffffffL)
+          exit(0);
+        for(k = 0; k < n; k += PGSIZE)
+          p[k] = i + j;
+        for(k = 0; k < n; k += PGSIZE){
+          if(p[k] != (char)(i + j)){
+            printf("%s: page %d of round %d is wrong\n", s, k / PGSIZE, j);
+            exit(1);
+          }
+        }
+        if(j % 3 == 2)
+          sbrk(base - (char*)sbrk(0));
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xst);
+    if(xst != 0)
+      exit(1);
+  }
+}
+
+// pipes, open files and in-memory inodes now come from the
+// slab allocator; churn through many of them at once from
+// several processes, freeing them in a different order.
+void
+slabchurn(char *s)
+{
+  int i, j, k, pid, xst;
+  int fds[6][2];
+  char name[8], c;
+
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[0] = 's';
+      name[1] = 'c';
+      name[2] = '0' + i;
+      name[4] = 0;
+      for(j = 0; j < 10; j++){
+        for(k = 0; k < 6; k++){
+          if(pipe(fds[k]) < 0){
+            printf("%s: pipe failed\n", s);
+            exit(1);
+          }
+          c = 'a' + i + j + k;
+          if(write(fds[k][1], &c, 1) != 1){
+            printf("%s: pipe write failed\n", s);
+            exit(1);
+          }
+        }
+        for(k = 5; k >= 0; k--){
+          if(read(fds[k][0], &c, 1) != 1 || c != 'a' + i + j + k){
+            printf("%s: pipe read got the wrong byte\n", s);
+            exit(1);
+          }
+          close(fds[k][k & 1]);
+        }
+        for(k = 0; k < 6; k++)
+          close(fds[k][(k & 1) ^ 1]);
+
+        name[3] = '0' + j;
+        k = open(name, O_CREATE|O_RDWR);
+        if(k < 0 || write(k, name, 4) != 4){
+          printf("%s: create %s failed\n", s, name);
+          exit(1);
+        }
+        close(k);
+      }
+      for(j = 0; j < 10; j++){
+        name[3] = '0' + j;
+        k = open(name, O_RDONLY);
+        if(k < 0 || read(k, fds, 4) != 4 || memcmp(fds, name, 4) != 0){
+          printf("%s: %s has the wrong content\n", s, name);
+          exit(1);
+        }
+        close(k);
+        unlink(name);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xst);
+    if(xst != 0)
+      exit(1);
+  }
+}
+
+// fork shares pages copy-on-write; writes by the child, by
+// the parent, and by the kernel on the child's behalf must
+// each see a private copy.
+void
+cowfork(char *s)
+{
+  int i, pid, xst, fds[2], n = 256;
+  char *p;
+
+  p = sbrk(n * PGSIZE);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++)
+    p[i * PGSIZE] = i;
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // a write by the kernel, through copyout().
+    if(read(fds[0], p + 5 * PGSIZE, 1) != 1 || p[5 * PGSIZE] != 'k'){
+      printf("%s: read into shared page failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n; i += 2)
+      p[i * PGSIZE] = 'c';
+    for(i = 0; i < n; i++){
+      if(p[i * PGSIZE] != (i % 2 == 0 ? 'c' : (char)i) && i != 5){
+        printf("%s: child page %d wrong\n", s, i);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  write(fds[1], "k", 1);
+  // the parent writes too, while the child may still share.
+  for(i = 1; i < n; i += 2)
+    p[i * PGSIZE] = 'p';
+  wait(&xst);
+  if(xst != 0)
+    exit(1);
+  for(i = 0; i < n; i++){
+    if(p[i * PGSIZE] != (i % 2 == 1 ? 'p' : (char)i)){
+      printf("%s: parent page %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-n * PGSIZE);
+}
+
+// sbrk() allocates heap pages only when they are first used,
+// by the process, by the kernel on its behalf, or after fork.
+void
+lazysbrk(char *s)
+{
+  enum { BIG = 64*1024*1024 };
+  char *a, *p;
+  int fd, pid, xst;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  // untouched pages read as zeros.
+  if(a[BIG/2] != 0 || a[BIG-1] != 0){
+    printf("%s: new heap isn't zero\n", s);
+    exit(1);
+  }
+
+  // the kernel writes into and reads from untouched pages.
+  fd = open("lazysbrk", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, a + 3*PGSIZE + 100, 10) != 10){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "lazy", 4) != 4){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("lazysbrk", O_RDONLY);
+  p = a + BIG - 2*PGSIZE - 5;
+  if(fd < 0 || read(fd, p, 14) != 14 || p[9] != 0 || memcmp(p + 10, "lazy", 4) != 0){
+    printf("%s: read into untouched pages failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("lazysbrk");
+
+  // a child sees what was touched, and zeros elsewhere.
+  a[PGSIZE] = 'x';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[PGSIZE] != 'x' || a[5*PGSIZE] != 0 || p[10] != 'l')
+      exit(1);
+    a[5*PGSIZE] = 'y';
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0){
+    printf("%s: child saw the wrong heap\n", s);
+    exit(1);
+  }
+
+  if(sbrk(-BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// exec() reads a program's pages in on first use; a page of
+// initialized data first touched by the kernel must still
+// hold its initial contents around what the kernel wrote.
+char xdata[3*PGSIZE] = { [0] = 'a', [PGSIZE] = 'b', [PGSIZE+20] = 'd', [2*PGSIZE] = 'c' };
+char xbss[2*PGSIZE];
+
+void
+lazyexec(char *s)
+{
+  int fds[2], pid, xst;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "0123456789", 10) != 10){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], xdata + PGSIZE + 5, 10) != 10){
+    printf("%s: read into data failed\n", s);
+    exit(1);
+  }
+  if(xdata[PGSIZE] != 'b' || xdata[PGSIZE+20] != 'd' || xdata[PGSIZE+5] != '0' ||
+     xdata[2*PGSIZE] != 'c' || xdata[0] != 'a'){
+    printf("%s: data page has the wrong contents\n", s);
+    exit(1);
+  }
+  if(write(fds[1], xdata + 2*PGSIZE, 1) != 1 || read(fds[0], xbss + PGSIZE, 1) != 1 ||
+     xbss[PGSIZE] != 'c' || xbss[0] != 0){
+    printf("%s: bss page has the wrong contents\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // a fresh program, run a few times.
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      char *argv[] = { "echo", 0 };
+      exec("echo", argv);
+      exit(1);
+    }
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: echo failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// a running program's read-only pages are the page cache's
+// own pages, so the program can't be opened for writing, and
+// the text in memory must match the file.
+void
+sharedtext(char *s)
+{
+  struct elfhdr elf;
+  struct proghdr ph;
+  char buf[512];
+  int fd, i, pid, xst;
+  uint64 off, n;
+
+  fd = open("/usertests", O_RDWR);
+  if(fd >= 0){
+    printf("%s: opened a running program for writing\n", s);
+    exit(1);
+  }
+  if((fd = open("/usertests", O_RDONLY)) < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(read(fd, &elf, sizeof(elf)) != sizeof(elf) || elf.magic != ELF_MAGIC){
+    printf("%s: bad ELF header\n", s);
+    exit(1);
+  }
+  for(i = 0; i < elf.phnum; i++){
+    if(pread(fd, &ph, sizeof(ph), elf.phoff + i*sizeof(ph)) != sizeof(ph)){
+      printf("%s: read program header failed\n", s);
+      exit(1);
+    }
+    if(ph.type == ELF_PROG_LOAD && (ph.flags & ELF_PROG_FLAG_WRITE) == 0)
+      break;
+  }
+  if(i == elf.phnum){
+    printf("%s: no text segment\n", s);
+    exit(1);
+  }
+  for(off = 0; off < ph.filesz; off += n){
+    n = ph.filesz - off < sizeof(buf) ? ph.filesz - off : sizeof(buf);
+    if(pread(fd, buf, n, ph.off + off) != n){
+      printf("%s: read text failed\n", s);
+      exit(1);
+    }
+    if(memcmp(buf, (char*)ph.vaddr + off, n) != 0){
+      printf("%s: text at %p differs from the file\n", s, (void*)(ph.vaddr + off));
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // several copies of a program at once share its text.
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      char *argv[] = { "echo", 0 };
+      exec("echo", argv);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: echo failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// a large, aligned heap gets superpages. They must read as
+// zeros, keep what is written, be shared copy-on-write by
+// fork, and survive the heap shrinking into the middle of one.
+void
+superpages(char *s)
+{
+  enum { SUPER = 2*1024*1024, BIG = 4*SUPER };
+  char *a, *top;
+  int i, fd, pid, xst;
+
+  top = sbrk(0);
+  a = (char*)(((uint64)top + SUPER - 1) & ~(uint64)(SUPER - 1));
+  if(sbrk(a - top + BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += PGSIZE){
+    if(a[i] != 0){
+      printf("%s: new heap isn't zero\n", s);
+      exit(1);
+    }
+    a[i] = i / PGSIZE;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < BIG; i += PGSIZE)
+      if(a[i] != (char)(i / PGSIZE))
+        exit(1);
+    for(i = 0; i < BIG; i += 3*PGSIZE)
+      a[i] = 'c';
+    for(i = 0; i < BIG; i += PGSIZE)
+      if(a[i] != (i % (3*PGSIZE) ? (char)(i / PGSIZE) : 'c'))
+        exit(1);
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0){
+    printf("%s: child saw the wrong heap\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: child's writes showed in parent\n", s);
+      exit(1);
+    }
+  }
+
+  // the kernel copies into and out of a superpage.
+  fd = open("superpages", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, a + SUPER + 3*PGSIZE, 1) != 1 || write(fd, "s", 1) != 1){
+    printf("%s: write from superpage failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("superpages", O_RDONLY);
+  if(fd < 0 || read(fd, a + 2*SUPER + 5, 2) != 2 ||
+     a[2*SUPER + 5] != (char)(SUPER/PGSIZE + 3) || a[2*SUPER + 6] != 's'){
+    printf("%s: read into superpage failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("superpages");
+
+  // shrink into the middle of the last superpage, and grow back.
+  if(sbrk(-(SUPER + SUPER/2)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG - SUPER - SUPER/2; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: shrink lost memory\n", s);
+      exit(1);
+    }
+  }
+  if(sbrk(SUPER + SUPER/2) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk grow failed\n", s);
+    exit(1);
+  }
+  for(i = BIG - SUPER - SUPER/2; i < BIG; i += PGSIZE){
+    if(a[i] != 0){
+      printf("%s: regrown heap isn't zero\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-(BIG + (a - top)));
+}
+
+// each process keeps its TLB entries across traps now, so the
+// kernel must flush them when it unmaps a page, including on
+// CPUs the process has since moved away from. a page freed
+// by sbrk() must fault however often the process has touched
+// it and moved between CPUs.
+void
+tlbflush(char *s)
+{
+  enum { N = 20 };
+  char *a;
+  int i, j, pid, xst;
+
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      a = sbrk(PGSIZE);
+      if(a == (char*)0xffffffffffffffffL)
+        exit(1);
+      for(j = 0; j < 1000; j++){
+        a[0] = j;
+        getpid();
+      }
+      sbrk(-PGSIZE);
+      for(j = 0; j < 100; j++)
+        getpid();
+      // should fault.
+      printf("%s: read freed page: %d\n", s, a[0]);
+      exit(1);
+    }
+    wait(&xst);
+    if(xst != -1){
+      printf("%s: freed page still mapped\n", s);
+      exit(1);
+    }
+  }
+}
+
+// the kernel copies to and from user memory directly through
+// user addresses now. it must still refuse the stack guard
+// page and the trapframe, map pages not yet used, and copy
+// large, unaligned buffers whole.
+void
+usercopy(char *s)
+{
+  enum { N = 3*PGSIZE + 123 };
+  char *sp, *a, *b;
+  int fd, i;
+
+  fd = open("usercopy", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  sp = (char *) r_sp();
+  sp -= USERSTACK*PGSIZE;
+  if(write(fd, sp, 1) != -1 || write(fd, (char*)TRAPFRAME, 8) != -1){
+    printf("%s: wrote from a page the user can't read\n", s);
+    exit(1);
+  }
+
+  a = sbrk(2*N);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    a[i] = i * 7;
+  // from an odd address.
+  if(write(fd, a + 1, N - 1) != N - 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("usercopy", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(read(fd, sp, 1) != -1 || read(fd, (char*)TRAPFRAME, 8) != -1){
+    printf("%s: read into a page the user can't write\n", s);
+    exit(1);
+  }
+  // into pages not mapped yet.
+  b = a + N + 5;
+  if(read(fd, b, N - 1) != N - 1){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  for(i = 1; i < N; i++){
+    if(b[i - 1] != (char)(i * 7)){
+      printf("%s: wrong byte %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("usercopy");
+  sbrk(-2*N);
+}
+
+// two processes each write() one file from a mapping of the
+// other, which must not deadlock on the two inode locks.
+void
+mmapcross(char *s)
+{
+  enum { SZ = 2*4096, N = 50 };
+  static char buf[SZ];
+  char *names[] = { "mmapx", "mmapy" };
+  char *p;
+  int fd, i, me, pid, xstatus, src, dst;
+
+  for(i = 0; i < 2; i++){
+    unlink(names[i]);
+    fd = open(names[i], O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, buf, SZ) != SZ){
+      printf("%s: create %s failed\n", s, names[i]);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  me = pid == 0;
+  src = open(names[me], O_RDONLY);
+  dst = open(names[!me], O_RDWR);
+  if(src < 0 || dst < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    p = mmap(0, SZ, PROT_READ, MAP_SHARED, src, 0);
+    if(p == (char*)-1){
+      printf("%s: mmap failed\n", s);
+      exit(1);
+    }
+    if(pwrite(dst, p, SZ, 0) != SZ){
+      printf("%s: write from a mapping failed\n", s);
+      exit(1);
+    }
+    munmap(p, SZ);
+  }
+  close(src);
+  close(dst);
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  unlink(names[0]);
+  unlink(names[1]);
+  exit(xstatus);
+}
+
+// a read() or wait() to a bad address fails without losing
+// the pipe's bytes or the child's exit status.
+void
+faultkeep(char *s)
+{
+  int fds[2], pid, xstatus;
+  char buf[8];
+  char *bad = (char*)0xffffffffffff0000LL;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "hi", 2) != 2){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], bad, 2) != -1){
+    printf("%s: read to a bad address succeeded\n", s);
+    exit(1);
+  }
+  if(read(fds[0], buf, sizeof(buf)) != 2 || buf[0] != 'h' || buf[1] != 'i'){
+    printf("%s: pipe lost its bytes\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(7);
+  if(wait((int*)bad) != -1){
+    printf("%s: wait to a bad address succeeded\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 7){
+    printf("%s: wait lost the child's status\n", s);
+    exit(1);
+  }
+}
+
+// a program can't be run while its file is open for writing.
+void
+execwriting(char *s)
+{
+  char buf[512];
+  char *args[] = { "execw", 0 };
+  int fd, efd, n, pid, xst;
+
+  if((efd = open("/echo", O_RDONLY)) < 0){
+    printf("%s: open echo failed\n", s);
+    exit(1);
+  }
+  if((fd = open("execw", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create execw failed\n", s);
+    exit(1);
+  }
+  while((n = read(efd, buf, sizeof(buf))) > 0){
+    if(write(fd, buf, n) != n){
+      printf("%s: write execw failed\n", s);
+      exit(1);
+    }
+  }
+  close(efd);
+
+  for(int i = 0; i < 2; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      exec("execw", args);
+      exit(7);
+    }
+    wait(&xst);
+    if(i == 0 && xst != 7){
+      printf("%s: ran a program open for writing\n", s);
+      exit(1);
+    }
+    if(i == 1 && xst != 0){
+      printf("%s: exec failed after close\n", s);
+      exit(1);
+    }
+    if(i == 0)
+      close(fd);
+  }
+  unlink("execw");
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2650,6 +4085,29 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {inlinefile, "inlinefile"},
+  {delayalloc, "delayalloc"},
+  {pagecache, "pagecache"},
+  {mmaptest, "mmaptest"},
+  {sendfiletest, "sendfiletest"},
+  {iovtest, "iovtest"},
+  {sharedread, "sharedread"},
+  {getdentstest, "getdentstest"},
+  {sparsefile, "sparsefile"},
+  {appendsize, "appendsize"},
+  {zeroedpages, "zeroedpages"},
+  {buddychurn, "buddychurn"},
+  {slabchurn, "slabchurn"},
+  {cowfork, "cowfork"},
+  {lazysbrk, "lazysbrk"},
+  {lazyexec, "lazyexec"},
+  {sharedtext, "sharedtext"},
+  {superpages, "superpages"},
+  {tlbflush, "tlbflush"},
+  {usercopy, "usercopy"},
+  {mmapcross, "mmapcross"},
+  {faultkeep, "faultkeep"},
+  {execwriting, "execwriting"},
 
   { 0, 0},
 };
@@ -2939,6 +4397,191 @@ outofinodes(char *s)
   }
 }
 
+// unlinking big files hands their blocks to a kernel thread;
+// writing and deleting more than the disk holds works
+// once it has freed them.
+void
+orphanreclaim(char *s)
+{
+  static char buf[BSIZE];
+  int fd, i, j, n, tries;
+
+  memset(buf, 'r', sizeof(buf));
+  for(i = 0; i < 12; i++){
+    fd = open("orphanf", O_CREATE|O_WRONLY);
+    if(fd < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < 200; j++){
+      for(tries = 0; (n = write(fd, buf, sizeof(buf))) != sizeof(buf); tries++){
+        // the blocks of the last copy may not be free yet.
+        if(n > 0 || tries > 100){
+          printf("%s: write %d of copy %d failed\n", s, j, i);
+          exit(1);
+        }
+        sleep(1);
+      }
+    }
+    close(fd);
+    if(unlink("orphanf") < 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// pages freed on one CPU's free list can be allocated on
+// another: after children on several CPUs allocate and free
+// memory, one process can still get nearly all of it.
+// sbrk() allocates lazily, so running out kills the process
+// that touches the page; countfree() counts in a child.
+int countfree();
+
+void
+kallocsteal(char *s)
+{
+  int i, j, pid, xstatus;
+  char *a;
+  uint64 n;
+
+  n = countfree();
+
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 20; j++){
+        a = sbrk(n/8*PGSIZE);
+        if(a == (char*)-1)
+          exit(0);  // the others got there first
+        for(char *p = a; p < a + n/8*PGSIZE; p += PGSIZE)
+          *p = 1;
+        sbrk(-(int)(n/8*PGSIZE));
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  // allow for pages the children's page tables took from
+  // the file page cache, which it keeps.
+  if(countfree() < n*9/10){
+    printf("%s: freed pages can't be allocated again\n", s);
+    exit(1);
+  }
+}
+
+// a heap bigger than physical memory, so that pages must go
+// to swap and come back, and fork() with pages swapped out.
+void
+swapbig(char *s)
+{
+  enum { BIG = 140*1024*1024 };
+  char *a;
+  int i, pid, xst;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += PGSIZE)
+    *(int*)(a + i) = i;
+  for(i = 0; i < BIG; i += PGSIZE){
+    if(*(int*)(a + i) != i){
+      printf("%s: page %d lost its contents\n", s, i / PGSIZE);
+      exit(1);
+    }
+  }
+
+  // the child shares the swapped-out pages. it reads only
+  // some of them, since pages shared since fork stay in
+  // memory.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < BIG; i += 64*PGSIZE){
+      if(*(int*)(a + i) != i){
+        printf("%s: child's page %d is wrong\n", s, i / PGSIZE);
+        exit(1);
+      }
+      *(int*)(a + i) = -1;
+    }
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0)
+    exit(xst);
+  for(i = 0; i < BIG; i += PGSIZE){
+    if(*(int*)(a + i) != i){
+      printf("%s: page %d changed by the child\n", s, i / PGSIZE);
+      exit(1);
+    }
+  }
+}
+
+// exec() maps none of the program; its text is read in a page
+// at a time as instructions are first fetched. usertests' text
+// spans many pages, and running one of its tests in a new
+// usertests fetches from pages all through it.
+void
+exectext(char *s)
+{
+  struct elfhdr elf;
+  struct proghdr ph;
+  char *args[] = { "usertests", "copyinstr1", 0 };
+  int fd, i, pid, xst;
+
+  if((fd = open("/usertests", O_RDONLY)) < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(read(fd, &elf, sizeof(elf)) != sizeof(elf) || elf.magic != ELF_MAGIC){
+    printf("%s: bad ELF header\n", s);
+    exit(1);
+  }
+  for(i = 0; i < elf.phnum; i++){
+    if(pread(fd, &ph, sizeof(ph), elf.phoff + i*sizeof(ph)) != sizeof(ph)){
+      printf("%s: read program header failed\n", s);
+      exit(1);
+    }
+    if(ph.type == ELF_PROG_LOAD && (ph.flags & ELF_PROG_FLAG_EXEC))
+      break;
+  }
+  close(fd);
+  if(i == elf.phnum || ph.memsz < 4*PGSIZE){
+    printf("%s: no text segment of several pages\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    exec("/usertests", args);
+    printf("%s: exec usertests failed\n", s);
+    exit(1);
+  }
+  wait(&xst);
+  if(xst != 0){
+    printf("%s: usertests copyinstr1 failed\n", s);
+    exit(1);
+  }
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2946,6 +4589,10 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {orphanreclaim, "orphanreclaim"},
+  {kallocsteal, "kallocsteal"},
+  {swapbig, "swapbig"},
+  {exectext, "exectext"},
     
   { 0, 0},
 };
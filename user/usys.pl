@@ -36,3 +36,12 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("sendfile");
+entry("readv");
+entry("writev");
+entry("pread");
+entry("pwrite");
+entry("getdents");
+entry("fallocate");